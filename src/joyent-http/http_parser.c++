@@ -1273,6 +1273,27 @@ size_t http_parser_execute (http_parser *parser,
 
       case s_header_field:
       {
+        if (parser->header_state == h_general && TOKEN(ch)) {
+          /* Fast path: once a header name is known not to be one we track, the only thing left
+           * to do is find the end of the token run.  Scan ahead with a tight table lookup
+           * instead of re-entering the state machine for every byte.  `p` is left on the last
+           * token byte; the bytes in between need no other processing.
+           */
+          const char* limit = data + len;
+          const char* start = p;
+          while (p + 1 != limit && TOKEN(p[1])) {
+            p++;
+          }
+          if (p != start) {
+            parser->nread += (uint64_t)(p - start);
+            if (parser->nread > HTTP_MAX_HEADER_SIZE) {
+              SET_ERRNO(HPE_HEADER_OVERFLOW);
+              goto error;
+            }
+          }
+          break;
+        }
+
         c = TOKEN(ch);
 
         if (c) {
@@ -1470,6 +1491,41 @@ size_t http_parser_execute (http_parser *parser,
 
       case s_header_value:
       {
+        if (parser->header_state == h_general) {
+          /* Fast path: nothing in a general header value is interesting until the CR or LF that
+           * ends it, so find the terminator with memchr(), which the C library vectorizes,
+           * rather than walking the state machine one byte at a time.  Cookie-laden headers are
+           * commonly hundreds of bytes long.  `p` is left on the last ordinary byte, so the
+           * terminator is handled by the normal code below exactly as before.
+           */
+          const char* limit = data + len;
+          const char* cr = (const char*) memchr(p, CR, limit - p);
+          const char* lf = (const char*) memchr(p, LF, limit - p);
+          const char* end;
+          if (cr != NULL && (lf == NULL || cr < lf)) {
+            end = cr;
+          } else if (lf != NULL) {
+            end = lf;
+          } else {
+            end = limit;
+          }
+
+          if (end != p) {
+            /* The byte at `p` (already counted in nread) and everything up to `end` is ordinary
+             * value data, which requires no processing in state h_general.
+             */
+            if (end - p > 1) {
+              parser->nread += (uint64_t)(end - p) - 1;
+              if (parser->nread > HTTP_MAX_HEADER_SIZE) {
+                SET_ERRNO(HPE_HEADER_OVERFLOW);
+                goto error;
+              }
+              p = end - 1;
+            }
+            break;
+          }
+          /* Otherwise the current byte is the terminator; fall through. */
+        }
 
         if (ch == CR) {
           parser->state = s_header_almost_done;
@@ -0,0 +1,498 @@
+// Sandstorm - Personal Cloud Sandbox
+// Copyright (c) 2014, Kenton Varda <temporal@gmail.com>
+// All rights reserved.
+//
+// This file is part of the Sandstorm platform implementation.
+//
+// Sandstorm is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation, either version 3 of the
+// License, or (at your option) any later version.
+//
+// Sandstorm is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Affero General Public License for more details.
+//
+// You should have received a copy of the GNU Affero General Public
+// License along with Sandstorm.  If not, see
+// <http://www.gnu.org/licenses/>.
+
+// Load harness for the legacy bridge (`make bench-bridge`).  Stands up a loopback HTTP server,
+// spawns the real bin/legacy-bridge binary against it (Cap'n Proto socket on FD 3, exactly as
+// the supervisor would), and then drives WebSession.get() or .post() through the real RPC
+// interfaces with configurable concurrency, request/response size, and keep-alive mix,
+// reporting p50/p99 latency and request throughput -- or, with --websocket, opens a WebSocket
+// and measures WebSocketPump throughput and batching.  Every perf-sensitive change to
+// legacy-bridge.c++ or http_parser.c++ should be validated with this before and after.
+
+// Hack around stdlib bug with C++14.
+#include <initializer_list>  // force libstdc++ to include its config
+#undef _GLIBCXX_HAVE_GETS    // correct broken config
+// End hack.
+
+#include <kj/main.h>
+#include <kj/debug.h>
+#include <kj/async-io.h>
+#include <capnp/rpc-twoparty.h>
+#include <capnp/rpc.capnp.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <vector>
+
+#include <sandstorm/grain.capnp.h>
+#include <sandstorm/web-session.capnp.h>
+
+namespace sandstorm {
+
+#if __QTCREATOR
+#define KJ_MVCAP(var) var
+#else
+#define KJ_MVCAP(var) var = ::kj::mv(var)
+#endif
+
+typedef unsigned int uint;
+typedef unsigned char byte;
+
+uint64_t nowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+class BenchHttpServer: private kj::TaskSet::ErrorHandler {
+  // A minimal loopback HTTP server playing the part of the sandboxed app.  It serves a canned
+  // response of a configured size to every request, closing the connection after every Nth
+  // response to exercise the bridge's reconnect path.
+
+public:
+  BenchHttpServer(kj::ConnectionReceiver& port, size_t bodySize, uint closeEvery,
+                  uint64_t wsTotalBytes)
+      : closeEvery(closeEvery), wsTotalBytes(wsTotalBytes), tasks(*this) {
+    auto body = kj::heapString(bodySize);
+    memset(body.begin(), 'x', bodySize);
+    keepAliveResponse = kj::str(
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: ", bodySize, "\r\n"
+        "\r\n", body);
+    closeResponse = kj::str(
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain\r\n"
+        "Connection: close\r\n"
+        "Content-Length: ", bodySize, "\r\n"
+        "\r\n", body);
+
+    upgradeResponse = kj::str(
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "\r\n");
+
+    wsChunk = kj::heapArray<byte>(bodySize == 0 ? 4096 : bodySize);
+    memset(wsChunk.begin(), 'w', wsChunk.size());
+
+    tasks.add(acceptLoop(port));
+  }
+
+private:
+  uint closeEvery;
+  uint responseCount = 0;
+  uint64_t wsTotalBytes;
+  kj::String keepAliveResponse;
+  kj::String closeResponse;
+  kj::String upgradeResponse;
+  kj::Array<byte> wsChunk;
+  kj::TaskSet tasks;
+
+  kj::Promise<void> acceptLoop(kj::ConnectionReceiver& port) {
+    return port.accept().then([this, &port](kj::Own<kj::AsyncIoStream>&& connection) {
+      auto& connectionRef = *connection;
+      tasks.add(serveLoop(connectionRef, kj::Vector<char>()).attach(kj::mv(connection)));
+      return acceptLoop(port);
+    });
+  }
+
+  kj::Promise<void> serveLoop(kj::AsyncIoStream& connection, kj::Vector<char>&& buffer) {
+    // Read until we've seen the end of a request's headers, then respond.  The client is our
+    // own bridge, so requests are well-formed.  POST bodies need no explicit handling:  the
+    // response goes out at end-of-headers, body bytes contain no CRLFCRLF, and whatever body
+    // remains in the stream simply accumulates ahead of the next request's headers, where the
+    // scan below skips past it.
+
+    size_t offset = buffer.size();
+    buffer.resize(offset + 4096);
+    auto promise = connection.tryRead(buffer.begin() + offset, 1, 4096);
+    return promise.then(
+        [this, &connection, offset, KJ_MVCAP(buffer)](size_t actual) mutable -> kj::Promise<void> {
+      if (actual == 0) {
+        return kj::READY_NOW;  // Client closed.
+      }
+      buffer.resize(offset + actual);
+
+      // Look for the end of headers.
+      size_t searchStart = offset < 3 ? 0 : offset - 3;
+      for (size_t i = searchStart; i + 3 < buffer.size(); i++) {
+        if (buffer[i] == '\r' && buffer[i+1] == '\n' &&
+            buffer[i+2] == '\r' && buffer[i+3] == '\n') {
+          // WebSocket upgrade?  Respond 101 and pump frames at the bridge until done.
+          static const char UPGRADE_HEADER[] = "Upgrade: websocket";
+          if (buffer.size() >= sizeof(UPGRADE_HEADER) - 1 &&
+              memmem(buffer.begin(), buffer.size(),
+                     UPGRADE_HEADER, sizeof(UPGRADE_HEADER) - 1) != nullptr) {
+            return connection.write(upgradeResponse.begin(), upgradeResponse.size())
+                .then([this, &connection]() {
+              return pumpWebSocket(connection, wsTotalBytes);
+            });
+          }
+
+          bool close = closeEvery > 0 && ++responseCount % closeEvery == 0;
+          kj::StringPtr response = close ? closeResponse : keepAliveResponse;
+          auto writePromise = connection.write(response.begin(), response.size());
+          if (close) {
+            return writePromise.then([&connection]() {
+              connection.shutdownWrite();
+            });
+          }
+          return writePromise.then([this, &connection]() {
+            return serveLoop(connection, kj::Vector<char>());
+          });
+        }
+      }
+
+      return serveLoop(connection, kj::mv(buffer));
+    });
+  }
+
+  kj::Promise<void> pumpWebSocket(kj::AsyncIoStream& connection, uint64_t remaining) {
+    if (remaining == 0) {
+      connection.shutdownWrite();
+      return kj::READY_NOW;
+    }
+
+    size_t n = kj::min((uint64_t)wsChunk.size(), remaining);
+    return connection.write(wsChunk.begin(), n).then([this, &connection, remaining, n]() {
+      return pumpWebSocket(connection, remaining - n);
+    });
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    // Connection errors (e.g. the bridge dropping a pooled connection) are expected; only log
+    // at debug level would be nice, but KJ_LOG(ERROR) is what we have and they are rare.
+    KJ_LOG(ERROR, exception);
+  }
+};
+
+class WsCounter final: public WebSession::WebSocketStream::Server {
+  // Client-side WebSocket endpoint:  counts the bytes and sendBytes() batches the bridge's pump
+  // delivers, fulfilling a promise once the expected total has arrived.
+
+public:
+  WsCounter(uint64_t expected, kj::Own<kj::PromiseFulfiller<void>> fulfiller,
+            uint64_t& receivedOut, uint64_t& batchesOut)
+      : expected(expected), fulfiller(kj::mv(fulfiller)),
+        receivedOut(receivedOut), batchesOut(batchesOut) {}
+
+protected:
+  kj::Promise<void> sendBytes(SendBytesContext context) override {
+    receivedOut += context.getParams().getMessage().size();
+    ++batchesOut;
+    if (receivedOut >= expected && fulfiller.get() != nullptr) {
+      fulfiller->fulfill();
+      fulfiller = nullptr;
+    }
+    return kj::READY_NOW;
+  }
+
+private:
+  uint64_t expected;
+  kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  uint64_t& receivedOut;
+  uint64_t& batchesOut;
+};
+
+class BridgeBenchMain {
+public:
+  BridgeBenchMain(kj::ProcessContext& context)
+      : context(context), ioContext(kj::setupAsyncIo()) {}
+
+  kj::MainFunc getMain() {
+    return kj::MainBuilder(context, "Sandstorm version 0.0",
+            "Benchmark <bridge-binary> (normally bin/legacy-bridge):  stands up a loopback HTTP "
+            "server, runs the bridge against it, and drives WebSession.get() through the real "
+            "Cap'n Proto interfaces, reporting latency percentiles and throughput.")
+        .addOptionWithArg({'n', "requests"}, KJ_BIND_METHOD(*this, setCount), "<count>",
+                          "Total number of requests to issue.  Default 10000.")
+        .addOptionWithArg({'c', "concurrency"}, KJ_BIND_METHOD(*this, setConcurrency), "<count>",
+                          "Number of requests to keep in flight.  Default 16.")
+        .addOptionWithArg({'s', "size"}, KJ_BIND_METHOD(*this, setBodySize), "<bytes>",
+                          "Response body size.  Default 4096.")
+        .addOptionWithArg({'x', "close-every"}, KJ_BIND_METHOD(*this, setCloseEvery), "<n>",
+                          "Have the server close the connection after every <n>th response, to "
+                          "mix connection churn into the keep-alive load.  0 (the default) "
+                          "never closes.")
+        .addOptionWithArg({'t', "threads"}, KJ_BIND_METHOD(*this, setThreads), "<count>",
+                          "Pass --threads <count> to the bridge.")
+        .addOptionWithArg({'p', "post"}, KJ_BIND_METHOD(*this, setPostSize), "<bytes>",
+                          "Benchmark POST instead of GET, sending a request body of <bytes> "
+                          "with each request.")
+        .addOptionWithArg({'w', "websocket"}, KJ_BIND_METHOD(*this, setWsBytes), "<bytes>",
+                          "Instead of request benchmarking, open a WebSocket and have the app "
+                          "pump <bytes> through the bridge (in -s sized chunks), reporting "
+                          "throughput and how well the pump batched them into sendBytes() "
+                          "calls.")
+        .expectArg("<bridge-binary>", KJ_BIND_METHOD(*this, setBridgeBinary))
+        .callAfterParsing(KJ_BIND_METHOD(*this, run))
+        .build();
+  }
+
+private:
+  kj::ProcessContext& context;
+  kj::AsyncIoContext ioContext;
+
+  kj::String bridgeBinary;
+  uint requestCount = 10000;
+  uint concurrency = 16;
+  size_t bodySize = 4096;
+  uint closeEvery = 0;
+  uint bridgeThreads = 0;
+
+  size_t postSize = 0;
+  uint64_t wsBytes = 0;
+  kj::Array<byte> postBody;
+
+  uint requestsStarted = 0;
+  uint requestsDone = 0;
+  std::vector<uint64_t> latencies;
+
+  kj::MainBuilder::Validity setBridgeBinary(kj::StringPtr arg) {
+    if (access(arg.cStr(), X_OK) < 0) {
+      return "Not an executable file.";
+    }
+    bridgeBinary = kj::heapString(arg);
+    return true;
+  }
+
+  kj::MainBuilder::Validity setCount(kj::StringPtr arg) { return parseUint(arg, requestCount); }
+  kj::MainBuilder::Validity setConcurrency(kj::StringPtr arg) {
+    return parseUint(arg, concurrency);
+  }
+  kj::MainBuilder::Validity setCloseEvery(kj::StringPtr arg) { return parseUint(arg, closeEvery); }
+  kj::MainBuilder::Validity setThreads(kj::StringPtr arg) { return parseUint(arg, bridgeThreads); }
+
+  kj::MainBuilder::Validity setBodySize(kj::StringPtr arg) {
+    uint size;
+    auto result = parseUint(arg, size);
+    bodySize = size;
+    return result;
+  }
+
+  kj::MainBuilder::Validity setPostSize(kj::StringPtr arg) {
+    uint size;
+    auto result = parseUint(arg, size);
+    postSize = size;
+    return result;
+  }
+
+  kj::MainBuilder::Validity setWsBytes(kj::StringPtr arg) {
+    uint size;
+    auto result = parseUint(arg, size);
+    wsBytes = size;
+    return result;
+  }
+
+  kj::MainBuilder::Validity parseUint(kj::StringPtr arg, uint& result) {
+    char* end;
+    result = strtoul(arg.cStr(), &end, 10);
+    if (arg.size() == 0 || *end != '\0') {
+      return "Expected a number.";
+    }
+    return true;
+  }
+
+  kj::MainBuilder::Validity run() {
+    // Stand up the app server on a loopback port.
+    auto listenAddress = ioContext.provider->getNetwork().parseAddress("127.0.0.1", 0)
+        .wait(ioContext.waitScope);
+    auto listener = listenAddress->listen();
+    auto serverAddrString = kj::str("127.0.0.1:", listener->getPort());
+    BenchHttpServer server(*listener, bodySize, closeEvery, wsBytes);
+
+    if (postSize > 0) {
+      postBody = kj::heapArray<byte>(postSize);
+      memset(postBody.begin(), 'p', postBody.size());
+    }
+
+    // Spawn the bridge with the Cap'n Proto socket on FD 3, the way the supervisor would.  The
+    // app command we hand it is just a placeholder process, since the "app" lives in-process
+    // here.
+    int fds[2];
+    KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+    pid_t bridgePid;
+    KJ_SYSCALL(bridgePid = fork());
+    if (bridgePid == 0) {
+      KJ_SYSCALL(dup2(fds[1], 3));
+      close(fds[0]);
+
+      auto threadArg = kj::str("--threads=", bridgeThreads);
+      const char* argv[6];
+      uint argc = 0;
+      argv[argc++] = bridgeBinary.cStr();
+      if (bridgeThreads > 0) {
+        argv[argc++] = threadArg.cStr();
+      }
+      argv[argc++] = serverAddrString.cStr();
+      // The placeholder app must not exit, since the bridge shuts down with its child.
+      argv[argc++] = "/bin/sleep";
+      argv[argc++] = "86400";
+      argv[argc] = nullptr;
+
+      char** argvp = const_cast<char**>(argv);
+      execv(argvp[0], argvp);
+      // If exec failed, don't run the harness's destructors.
+      _exit(1);
+    }
+    KJ_SYSCALL(close(fds[1]));
+    KJ_DEFER(kill(bridgePid, SIGKILL));
+
+    // Connect to the bridge as its Cap'n Proto client.
+    auto stream = ioContext.lowLevelProvider->wrapSocketFd(
+        fds[0], kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+    capnp::TwoPartyVatNetwork network(*stream, capnp::rpc::twoparty::Side::SERVER);
+    auto rpcSystem = capnp::makeRpcClient(network);
+
+    capnp::MallocMessageBuilder refMessage;
+    capnp::rpc::SturdyRef::Builder ref = refMessage.getRoot<capnp::rpc::SturdyRef>();
+    auto hostId = ref.getHostId().initAs<capnp::rpc::twoparty::SturdyRefHostId>();
+    hostId.setSide(capnp::rpc::twoparty::Side::CLIENT);
+    UiView::Client view = rpcSystem.restore(hostId, ref.getObjectId()).castAs<UiView>();
+
+    // Open a session.
+    auto sessionRequest = view.newSessionRequest();
+    sessionRequest.getUserInfo().getDisplayName().setDefaultText("Bench User");
+    sessionRequest.setSessionType(capnp::typeId<WebSession>());
+    auto sessionParams = sessionRequest.getSessionParams().initAs<WebSession::Params>();
+    sessionParams.setBasePath("http://bench.example.com");
+    sessionParams.setUserAgent("bridge-bench");
+    sessionParams.initAcceptableLanguages(1).set(0, "en");
+
+    WebSession::Client session =
+        sessionRequest.send().getSession().castAs<WebSession>();
+
+    if (wsBytes > 0) {
+      return runWebSocketBench(session);
+    }
+
+    latencies.reserve(requestCount);
+
+    // Issue requests, keeping `concurrency` in flight.
+    uint64_t benchStart = nowNanos();
+    {
+      kj::Vector<kj::Promise<void>> drivers(concurrency);
+      for (uint i = 0; i < concurrency; i++) {
+        drivers.add(driver(session));
+      }
+      for (auto& d: drivers) {
+        d.wait(ioContext.waitScope);
+      }
+    }
+    uint64_t benchNanos = nowNanos() - benchStart;
+
+    report(benchNanos);
+    return true;
+  }
+
+  kj::MainBuilder::Validity runWebSocketBench(WebSession::Client& session) {
+    // Drive WebSocketPump:  the app pushes wsBytes through the bridge, and we measure wall time
+    // plus how many sendBytes() batches it took -- the batching ratio is the whole point of the
+    // pump's coalescing.
+
+    uint64_t received = 0;
+    uint64_t batches = 0;
+    auto paf = kj::newPromiseAndFulfiller<void>();
+
+    auto request = session.openWebSocketRequest();
+    request.setPath("");
+    request.setClientStream(
+        kj::heap<WsCounter>(wsBytes, kj::mv(paf.fulfiller), received, batches));
+
+    uint64_t start = nowNanos();
+    auto response = request.send().wait(ioContext.waitScope);
+    paf.promise.wait(ioContext.waitScope);
+    uint64_t nanos = nowNanos() - start;
+
+    auto msg = kj::str(
+        "websocket:    ", received, " bytes in ", batches, " batches\n",
+        "throughput:   ", received * 1000000ull / (nanos / 1000 + 1), " bytes/s\n",
+        "avg batch:    ", batches == 0 ? 0 : received / batches, " bytes\n",
+        "elapsed:      ", nanos / 1000000, " ms\n");
+    kj::FdOutputStream(STDOUT_FILENO).write(msg.begin(), msg.size());
+    return true;
+  }
+
+  capnp::RemotePromise<WebSession::Response> sendOne(WebSession::Client& session) {
+    if (postSize > 0) {
+      auto request = session.postRequest();
+      request.setPath("");
+      auto content = request.initContent();
+      content.setMimeType("application/octet-stream");
+      content.setContent(postBody);
+      return request.send();
+    } else {
+      auto request = session.getRequest();
+      request.setPath("");
+      return request.send();
+    }
+  }
+
+  kj::Promise<void> driver(WebSession::Client session) {
+    // One lane of the configured concurrency:  issue requests back to back until the total count
+    // is reached.
+
+    if (requestsStarted >= requestCount) {
+      return kj::READY_NOW;
+    }
+    ++requestsStarted;
+
+    uint64_t start = nowNanos();
+    return sendOne(session).then(
+        [this, KJ_MVCAP(session), start](capnp::Response<WebSession::Response>&& response)
+        mutable -> kj::Promise<void> {
+      KJ_ASSERT(response.isContent(), "App returned non-content response?");
+      KJ_ASSERT(response.getContent().getBody().getBytes().size() == bodySize,
+                "Body size mismatch.");
+      latencies.push_back(nowNanos() - start);
+      ++requestsDone;
+      return driver(kj::mv(session));
+    });
+  }
+
+  void report(uint64_t benchNanos) {
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) -> uint64_t {
+      if (latencies.empty()) return 0;
+      size_t index = (size_t)(p * (latencies.size() - 1));
+      return latencies[index];
+    };
+
+    auto msg = kj::str(
+        "requests:     ", requestsDone, "\n",
+        "concurrency:  ", concurrency, "\n",
+        "body size:    ", bodySize, "\n",
+        "close every:  ", closeEvery, "\n",
+        "throughput:   ", requestsDone * 1000000000ull / benchNanos, " req/s\n",
+        "latency p50:  ", percentile(0.50) / 1000, " us\n",
+        "latency p90:  ", percentile(0.90) / 1000, " us\n",
+        "latency p99:  ", percentile(0.99) / 1000, " us\n",
+        "latency max:  ", percentile(1.0) / 1000, " us\n");
+    kj::FdOutputStream(STDOUT_FILENO).write(msg.begin(), msg.size());
+  }
+};
+
+}  // namespace sandstorm
+
+KJ_MAIN(sandstorm::BridgeBenchMain)
@@ -38,17 +38,26 @@
 #include <kj/main.h>
 #include <kj/debug.h>
 #include <kj/async-io.h>
+#include <kj/refcount.h>
 #include <capnp/rpc-twoparty.h>
 #include <capnp/rpc.capnp.h>
 #include <capnp/schema.h>
 #include <unistd.h>
-#include <map>
+#include <sys/eventfd.h>
 #include <unordered_map>
+#include <deque>
+#include <mutex>
 #include <time.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <kj/thread.h>
+
+#include <atomic>
 
 #include <sandstorm/grain.capnp.h>
 #include <sandstorm/web-session.capnp.h>
+#include <sandstorm/bridge-stats.capnp.h>
 #include <joyent-http/http_parser.h>
 
 namespace sandstorm {
@@ -101,12 +110,128 @@ kj::ArrayPtr<const char> trim(kj::ArrayPtr<const char> input) {
   return input;
 }
 
-void toLower(kj::ArrayPtr<char> text) {
-  for (char& c: text) {
-    if ('A' <= c && c <= 'Z') {
-      c = c - 'A' + 'a';
+bool equalsIgnoreCase(kj::ArrayPtr<const char> text, kj::StringPtr expected) {
+  if (text.size() != expected.size()) return false;
+  for (size_t i = 0; i < text.size(); i++) {
+    char c = text[i];
+    if ('A' <= c && c <= 'Z') c = c - 'A' + 'a';
+    if (c != expected[i]) return false;
+  }
+  return true;
+}
+
+kj::Maybe<int64_t> parseHttpDate(kj::ArrayPtr<const char> text) {
+  // Parse the three date formats HTTP allows:
+  //   Wed, 15 Nov 1995 06:25:24 GMT    (RFC 1123)
+  //   Wednesday, 15-Nov-95 06:25:24 GMT  (RFC 850)
+  //   Wed Nov 15 06:25:24 1995         (asctime)
+  // This replaces strptime(), which drags in locale machinery on what is (for cookie-heavy
+  // apps) a hot path.  Returns a unix timestamp, or null if the text matches none of the
+  // formats.
+
+  const char* p = text.begin();
+  const char* end = text.end();
+
+  auto skipSpaces = [&]() {
+    while (p != end && *p == ' ') ++p;
+  };
+
+  auto readNumber = [&](uint digitsMin, uint digitsMax, int& result) -> bool {
+    uint digits = 0;
+    result = 0;
+    while (p != end && '0' <= *p && *p <= '9' && digits < digitsMax) {
+      result = result * 10 + (*p - '0');
+      ++p;
+      ++digits;
+    }
+    return digits >= digitsMin;
+  };
+
+  auto readMonth = [&](int& result) -> bool {
+    static const char MONTHS[] = "janfebmaraprmayjunjulaugsepoctnovdec";
+    if (end - p < 3) return false;
+    char name[3];
+    for (uint i = 0; i < 3; i++) {
+      char c = p[i];
+      if ('A' <= c && c <= 'Z') c = c - 'A' + 'a';
+      name[i] = c;
+    }
+    for (int month = 0; month < 12; month++) {
+      if (memcmp(name, MONTHS + month * 3, 3) == 0) {
+        result = month;
+        p += 3;
+        return true;
+      }
+    }
+    return false;
+  };
+
+  auto expect = [&](char c) -> bool {
+    if (p != end && *p == c) { ++p; return true; }
+    return false;
+  };
+
+  // Skip the day-of-week name and any comma after it.
+  while (p != end && ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z'))) ++p;
+  if (p != end && *p == ',') ++p;
+  skipSpaces();
+  if (p == end) return nullptr;
+
+  struct tm t;
+  memset(&t, 0, sizeof(t));
+  bool expectGmt;
+
+  if ('0' <= *p && *p <= '9') {
+    // RFC 1123 or RFC 850:  day first.
+    if (!readNumber(1, 2, t.tm_mday)) return nullptr;
+
+    if (expect(' ')) {
+      // RFC 1123:  "15 Nov 1995".
+      int year;
+      if (!readMonth(t.tm_mon) || !expect(' ') || !readNumber(4, 4, year)) return nullptr;
+      t.tm_year = year - 1900;
+    } else if (expect('-')) {
+      // RFC 850:  "15-Nov-95".  Two-digit years follow the usual 69-99 -> 19xx convention.
+      int year;
+      if (!readMonth(t.tm_mon) || !expect('-') || !readNumber(2, 2, year)) return nullptr;
+      t.tm_year = year >= 69 ? year : year + 100;
+    } else {
+      return nullptr;
+    }
+
+    skipSpaces();
+    if (!readNumber(2, 2, t.tm_hour) || !expect(':') ||
+        !readNumber(2, 2, t.tm_min) || !expect(':') ||
+        !readNumber(2, 2, t.tm_sec)) {
+      return nullptr;
+    }
+    expectGmt = true;
+  } else {
+    // asctime:  "Nov 15 06:25:24 1995" (day may be space-padded).
+    if (!readMonth(t.tm_mon)) return nullptr;
+    skipSpaces();
+    if (!readNumber(1, 2, t.tm_mday)) return nullptr;
+    skipSpaces();
+    if (!readNumber(2, 2, t.tm_hour) || !expect(':') ||
+        !readNumber(2, 2, t.tm_min) || !expect(':') ||
+        !readNumber(2, 2, t.tm_sec)) {
+      return nullptr;
     }
+    skipSpaces();
+    int year;
+    if (!readNumber(4, 4, year)) return nullptr;
+    t.tm_year = year - 1900;
+    expectGmt = false;
   }
+
+  if (expectGmt) {
+    skipSpaces();
+    if (end - p != 3 || memcmp(p, "GMT", 3) != 0) return nullptr;
+    p += 3;
+  }
+  if (p != end) return nullptr;
+
+  return (int64_t)timegm(&t);
 }
 
 struct HttpStatusInfo {
@@ -167,35 +292,317 @@ std::unordered_map<uint, HttpStatusInfo> makeStatusCodes() {
 const std::unordered_map<uint, HttpStatusInfo> HTTP_STATUS_CODES = makeStatusCodes();
 #pragma clang diagnostic pop
 
-class HttpParser: private http_parser {
+uint64_t nowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+class BridgeMetrics {
+  // Instrumentation counters for one thread (see BridgeStats in bridge-stats.capnp).  Writers
+  // use relaxed atomic increments -- a few per request, no allocation -- so this is safe to
+  // update from the owning thread while the main thread's stats collector reads it.
+
+public:
+  static constexpr uint BUCKETS = 32;
+
+  void recordConnection(bool fresh) {
+    bump(fresh ? connectionsOpened : connectionsReused);
+  }
+
+  void recordRequest(uint64_t latencyNs) {
+    bump(requestCount);
+    bump(latencyBuckets[bucket(latencyNs)]);
+  }
+
+  void recordError() {
+    bump(requestErrors);
+  }
+
+  void recordBodySize(uint64_t size) {
+    bump(sizeBuckets[bucket(size)]);
+  }
+
+  void recordWebSocketSend(uint64_t bytes) {
+    bump(webSocketSends);
+    webSocketBytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  // Read side (used by BridgeStatsImpl; relaxed loads).
+  std::atomic<uint64_t> requestCount{0};
+  std::atomic<uint64_t> requestErrors{0};
+  std::atomic<uint64_t> connectionsOpened{0};
+  std::atomic<uint64_t> connectionsReused{0};
+  std::atomic<uint64_t> webSocketSends{0};
+  std::atomic<uint64_t> webSocketBytes{0};
+  std::atomic<uint64_t> latencyBuckets[BUCKETS] = {};
+  std::atomic<uint64_t> sizeBuckets[BUCKETS] = {};
+
+private:
+  static void bump(std::atomic<uint64_t>& counter) {
+    counter.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static uint bucket(uint64_t value) {
+    if (value == 0) return 0;
+    uint bits = 64 - __builtin_clzll(value);
+    return bits >= BUCKETS ? BUCKETS - 1 : bits;
+  }
+};
+
+constexpr uint BridgeMetrics::BUCKETS;
+
+class MetricsRegistry {
+  // Owns the per-thread metrics blocks.  add() may only be called at startup, before the threads
+  // and the stats collector exist; after that the set is read-only.
+
 public:
-  HttpParser() {
+  BridgeMetrics& add() {
+    auto metrics = kj::heap<BridgeMetrics>();
+    auto& result = *metrics;
+    blocks.add(kj::mv(metrics));
+    return result;
+  }
+
+  kj::ArrayPtr<const kj::Own<BridgeMetrics>> getBlocks() const {
+    return blocks.asPtr();
+  }
+
+private:
+  kj::Vector<kj::Own<BridgeMetrics>> blocks;
+};
+
+class BridgeStatsImpl final: public BridgeStats::Server {
+public:
+  explicit BridgeStatsImpl(MetricsRegistry& registry): registry(registry) {}
+
+  kj::Promise<void> get(GetContext context) override {
+    auto stats = context.getResults().initStats();
+
+    uint64_t requestCount = 0, requestErrors = 0;
+    uint64_t connectionsOpened = 0, connectionsReused = 0;
+    uint64_t webSocketSends = 0, webSocketBytes = 0;
+    uint64_t latency[BridgeMetrics::BUCKETS] = {0};
+    uint64_t sizes[BridgeMetrics::BUCKETS] = {0};
+
+    for (auto& block: registry.getBlocks()) {
+      requestCount += block->requestCount.load(std::memory_order_relaxed);
+      requestErrors += block->requestErrors.load(std::memory_order_relaxed);
+      connectionsOpened += block->connectionsOpened.load(std::memory_order_relaxed);
+      connectionsReused += block->connectionsReused.load(std::memory_order_relaxed);
+      webSocketSends += block->webSocketSends.load(std::memory_order_relaxed);
+      webSocketBytes += block->webSocketBytes.load(std::memory_order_relaxed);
+      for (uint i = 0; i < BridgeMetrics::BUCKETS; i++) {
+        latency[i] += block->latencyBuckets[i].load(std::memory_order_relaxed);
+        sizes[i] += block->sizeBuckets[i].load(std::memory_order_relaxed);
+      }
+    }
+
+    stats.setRequestCount(requestCount);
+    stats.setRequestErrors(requestErrors);
+    stats.setConnectionsOpened(connectionsOpened);
+    stats.setConnectionsReused(connectionsReused);
+    stats.setWebSocketSends(webSocketSends);
+    stats.setWebSocketBytes(webSocketBytes);
+
+    auto latencyList = stats.initLatencyNs(BridgeMetrics::BUCKETS);
+    auto sizeList = stats.initBodySizes(BridgeMetrics::BUCKETS);
+    for (uint i = 0; i < BridgeMetrics::BUCKETS; i++) {
+      latencyList.set(i, latency[i]);
+      sizeList.set(i, sizes[i]);
+    }
+
+    return kj::READY_NOW;
+  }
+
+private:
+  MetricsRegistry& registry;
+};
+
+constexpr uint32_t headerKey(const char* name, size_t size) {
+  // A trivially-computed key which happens to be distinct for every header the bridge tracks
+  // (checked at compile time below):  length combined with the lowercased last character.
+  // Dispatch is a constant-time switch on this key followed by one full comparison, instead of
+  // a map of heap-allocated lowercased names.
+  return size == 0 ? 0 : (uint32_t)size * 256 + (uint32_t)(name[size - 1] | 0x20);
+}
+
+template <size_t size>
+constexpr uint32_t headerKey(const char (&name)[size]) {
+  return headerKey(name, size - 1);
+}
+
+constexpr uint32_t KEY_SET_COOKIE             = headerKey("set-cookie");
+constexpr uint32_t KEY_CONTENT_DISPOSITION    = headerKey("content-disposition");
+constexpr uint32_t KEY_CONTENT_ENCODING       = headerKey("content-encoding");
+constexpr uint32_t KEY_CONTENT_LANGUAGE       = headerKey("content-language");
+constexpr uint32_t KEY_CONTENT_TYPE           = headerKey("content-type");
+constexpr uint32_t KEY_LOCATION               = headerKey("location");
+constexpr uint32_t KEY_SEC_WEBSOCKET_PROTOCOL = headerKey("sec-websocket-protocol");
+
+constexpr bool headerKeysDistinct() {
+  uint32_t keys[] = { KEY_SET_COOKIE, KEY_CONTENT_DISPOSITION, KEY_CONTENT_ENCODING,
+                      KEY_CONTENT_LANGUAGE, KEY_CONTENT_TYPE, KEY_LOCATION,
+                      KEY_SEC_WEBSOCKET_PROTOCOL };
+  for (uint i = 0; i < kj::size(keys); i++) {
+    for (uint j = i + 1; j < kj::size(keys); j++) {
+      if (keys[i] == keys[j]) return false;
+    }
+  }
+  return true;
+}
+static_assert(headerKeysDistinct(), "headerKey() no longer distinguishes the tracked headers.");
+
+class HttpParser: public kj::Refcounted, private http_parser {
+public:
+  explicit HttpParser(kj::Maybe<ByteStream::Client> responseStream = nullptr)
+      : responseStream(kj::mv(responseStream)),
+        writeQueue(kj::READY_NOW) {
     memset(&settings, 0, sizeof(settings));
     settings.on_status = &on_status;
     settings.on_header_field = &on_header_field;
     settings.on_header_value = &on_header_value;
+    settings.on_headers_complete = &on_headers_complete;
     settings.on_body = &on_body;
+    settings.on_message_complete = &on_message_complete;
     http_parser_init(this, HTTP_RESPONSE);
   }
 
-  void parse(kj::ArrayPtr<const char> data) {
+  void feed(kj::ArrayPtr<const char> data) {
+    // Feed the parser a chunk of the response as it arrives off the wire.
+
+    sawData = sawData || data.size() > 0;
     size_t n = http_parser_execute(this, &settings, data.begin(), data.size());
-    if (n != data.size() || HTTP_PARSER_ERRNO(this) != HPE_OK) {
+    if (HTTP_PARSER_ERRNO(this) == HPE_PAUSED) {
+      // We paused the parser at the end of the response.  Any bytes past that point would belong
+      // to a response nobody asked for.
+      KJ_ASSERT(n == data.size(), "Sandboxed app sent data past the end of its HTTP response.");
+    } else if (n != data.size() || HTTP_PARSER_ERRNO(this) != HPE_OK) {
       const char* error = http_errno_description(HTTP_PARSER_ERRNO(this));
       KJ_FAIL_ASSERT("Failed to parse HTTP response from sandboxed app.", error);
     }
+  }
 
+  void parse(kj::ArrayPtr<const char> data) {
+    feed(data);
     KJ_ASSERT(status_code >= 100, (int)status_code);
   }
 
+  bool isComplete() { return messageComplete; }
+  // Did the parser see a full response?  Once this is true there is no need to wait for EOF;
+  // the response was framed by Content-Length or chunked encoding.
+
+  bool canReuseConnection() { return messageComplete && shouldKeepAlive; }
+  // May the connection that carried this response be used for another request?
+
+  bool sawAnyData() { return sawData; }
+
+  bool isStreaming() { return streaming; }
+  // Is the body being forwarded to the client's response stream rather than accumulated?
+
+  uint64_t bodySize() {
+    // Response body bytes seen so far.
+    return streaming ? streamedBytes
+         : direct    ? directBodyOffset
+                     : body.size();
+  }
+
+  kj::Maybe<uint64_t> identityBodyRemaining() {
+    // For a streaming response whose body is a plain Content-Length-delimited run (no chunked
+    // encoding), the number of body bytes not yet read off the socket.  The parser conveniently
+    // counts content_length down as body bytes pass through it, so this is exact even if part
+    // of the body arrived along with the headers.  Null for chunked or EOF-delimited bodies,
+    // which must keep going through the parser.
+
+    if (streaming && !(flags & F_CHUNKED) && content_length != ULLONG_MAX) {
+      return content_length;
+    }
+    return nullptr;
+  }
+
+  void sendBodyBytes(kj::ArrayPtr<const byte> data) {
+    // Forward body bytes to the response stream.  Used both by the parser's on_body callback
+    // and by ResponseStreamPump's parser-bypassing fast path.
+
+    KJ_REQUIRE(streaming);
+    streamedBytes += data.size();
+    auto& stream = KJ_ASSERT_NONNULL(responseStream);
+    auto req = stream.writeRequest(
+        capnp::MessageSize { data.size() / sizeof(capnp::word) + 8, 0 });
+    req.setData(data);
+    auto promise = req.send().then([](auto response) {});
+    writeQueue = writeQueue.then([KJ_MVCAP(promise)]() mutable {
+      return kj::mv(promise);
+    });
+  }
+
+  void setResponseBuilder(WebSession::Response::Builder builder) {
+    // Give the parser the response builder up front.  Once the headers are complete, the status,
+    // cookies, and other header-derived fields are all known, so for a content response with a
+    // Content-Length the parser builds the response immediately and lands body bytes straight in
+    // the message's preallocated Data segment as they arrive -- one copy off the socket buffer,
+    // rather than accumulating in a growing vector and copying again at the end.
+
+    responseBuilder = builder;
+  }
+
+  kj::Promise<void> flushStreamingWrites() {
+    // Wait until the client has acknowledged all body bytes handed to the response stream so
+    // far.  Pausing reads until this resolves is what bounds our buffering:  a fast app can
+    // never get more than one read's worth of data ahead of a slow client.
+
+    auto result = kj::mv(writeQueue);
+    writeQueue = kj::READY_NOW;
+    return result;
+  }
+
+  kj::Promise<void> finishStreaming() {
+    // Flush the remaining body bytes and signal end-of-stream to the client.
+
+    KJ_REQUIRE(streaming);
+    auto stream = KJ_ASSERT_NONNULL(responseStream);
+    return flushStreamingWrites().then([KJ_MVCAP(stream)]() mutable {
+      return stream.doneRequest(capnp::MessageSize {4, 0}).send().then([](auto response) {});
+    });
+  }
+
+  void abortStreaming() {
+    // Drop the response stream without calling done(), which is how the client learns that the
+    // stream was aborted rather than completed.
+
+    responseStream = nullptr;
+    writeQueue = kj::READY_NOW;
+  }
+
   void build(WebSession::Response::Builder builder) {
-    // Let the parser know about EOF.
-    if (http_parser_execute(this, &settings, nullptr, 0) != 0 ||
-        HTTP_PARSER_ERRNO(this) != HPE_OK) {
-      const char* error = http_errno_description(HTTP_PARSER_ERRNO(this));
-      KJ_FAIL_ASSERT("Failed to parse HTTP response from sandboxed app.", error);
+    if (!messageComplete && !streaming) {
+      // The response was delimited by EOF rather than by its own framing, so we have to let the
+      // parser know about the EOF.  (For a streaming response we get here right after the
+      // headers, with the parser legitimately mid-body -- feeding EOF now would be an error;
+      // the pump delivers the real EOF via feed(nullptr) when the body actually ends.)
+      //
+      // If the EOF completes the message, on_message_complete pauses the parser (see
+      // onMessageComplete()), so HPE_PAUSED is the *success* outcome here, just as in feed().
+      size_t n = http_parser_execute(this, &settings, nullptr, 0);
+      if (HTTP_PARSER_ERRNO(this) != HPE_PAUSED &&
+          (n != 0 || HTTP_PARSER_ERRNO(this) != HPE_OK)) {
+        const char* error = http_errno_description(HTTP_PARSER_ERRNO(this));
+        KJ_FAIL_ASSERT("Failed to parse HTTP response from sandboxed app.", error);
+      }
+    }
+
+    if (direct) {
+      // Already built at headers-complete time, with the body written in place as it arrived.
+      KJ_ASSERT(directBodyOffset == directBody.size(),
+                "Response body shorter than Content-Length.");
+      return;
     }
 
+    buildImpl(builder);
+  }
+
+private:
+  void buildImpl(WebSession::Response::Builder builder) {
     KJ_ASSERT(!upgrade,
         "Sandboxed app attempted to upgrade protocol when client did not request this.");
 
@@ -215,23 +622,10 @@ public:
           "because some have sandbox-breaking effects.", (uint)status_code, statusString);
     }
 
-    auto cookieList = builder.initSetCookies(cookies.size());
-    for (size_t i: kj::indices(cookies)) {
-      auto cookie = cookieList[i];
-      cookie.setName(cookies[i].name);
-      cookie.setValue(cookies[i].value);
-      switch (cookies[i].expirationType) {
-        case Cookie::ExpirationType::NONE:
-          cookie.getExpires().setNone();
-          break;
-        case Cookie::ExpirationType::ABSOLUTE:
-          cookie.getExpires().setAbsolute(cookies[i].expires);
-          break;
-        case Cookie::ExpirationType::RELATIVE:
-          cookie.getExpires().setRelative(cookies[i].expires);
-          break;
-      }
-      cookie.setHttpOnly(cookies[i].httpOnly);
+    auto cookieList = builder.initSetCookies(cookieHeaders.size());
+    for (size_t i: kj::indices(cookieHeaders)) {
+      auto& view = cookieHeaders[i];
+      buildCookie(arena.asPtr().slice(view.offset, view.offset + view.size), cookieList[i]);
     }
 
     switch (statusInfo.type) {
@@ -239,16 +633,16 @@ public:
         auto content = builder.initContent();
         content.setStatusCode(statusInfo.successCode);
 
-        KJ_IF_MAYBE(encoding, findHeader("content-encoding")) {
-          content.setEncoding(*encoding);
+        KJ_IF_MAYBE(encoding, getHeader(HEADER_CONTENT_ENCODING)) {
+          content.setEncoding(capnp::Text::Reader(encoding->begin(), encoding->size()));
         }
-        KJ_IF_MAYBE(language, findHeader("content-language")) {
-          content.setLanguage(*language);
+        KJ_IF_MAYBE(language, getHeader(HEADER_CONTENT_LANGUAGE)) {
+          content.setLanguage(capnp::Text::Reader(language->begin(), language->size()));
         }
-        KJ_IF_MAYBE(mimeType, findHeader("content-type")) {
-          content.setMimeType(*mimeType);
+        KJ_IF_MAYBE(mimeType, getHeader(HEADER_CONTENT_TYPE)) {
+          content.setMimeType(capnp::Text::Reader(mimeType->begin(), mimeType->size()));
         }
-        KJ_IF_MAYBE(disposition, findHeader("content-disposition")) {
+        KJ_IF_MAYBE(disposition, getHeader(HEADER_CONTENT_DISPOSITION)) {
           // Parse `attachment; filename="foo"`
           // TODO(cleanup):  This is awful.  Use KJ parser library?
           auto parts = split(*disposition, ';');
@@ -293,16 +687,24 @@ public:
           }
         }
 
-        auto data = content.initBody().initBytes(body.size());
-        memcpy(data.begin(), body.begin(), body.size());
+        if (streaming) {
+          // The body union is filled in by the caller, which owns the handle capability.
+        } else if (direct) {
+          // Preallocate the body in the message; onBody() writes into it directly.
+          directBody = content.initBody().initBytes(content_length);
+        } else {
+          auto data = content.initBody().initBytes(body.size());
+          memcpy(data.begin(), body.begin(), body.size());
+        }
         break;
       }
       case WebSession::Response::REDIRECT: {
         auto redirect = builder.initRedirect();
         redirect.setIsPermanent(statusInfo.redirect.isPermanent);
         redirect.setSwitchToGet(statusInfo.redirect.switchToGet);
-        redirect.setLocation(KJ_ASSERT_NONNULL(findHeader("location"),
-            "Application returned redirect response missing Location header.", (int)status_code));
+        auto location = KJ_ASSERT_NONNULL(getHeader(HEADER_LOCATION),
+            "Application returned redirect response missing Location header.", (int)status_code);
+        redirect.setLocation(capnp::Text::Reader(location.begin(), location.size()));
         break;
       }
       case WebSession::Response::CLIENT_ERROR: {
@@ -320,6 +722,7 @@ public:
     }
   }
 
+public:
   void buildForWebSocket(WebSession::OpenWebSocketResults::Builder builder) {
     // TODO(soon):  If the app returned a normal response without upgrading, we should forward that
     //   through, as it's perfectly valid HTTP.  The WebSession interface currently does not
@@ -327,7 +730,7 @@ public:
     KJ_ASSERT(status_code == 101, "Sandboxed app does not support WebSocket.",
               (int)upgrade, (int)status_code, statusString);
 
-    KJ_IF_MAYBE(protocol, findHeader("sec-websocket-protocol")) {
+    KJ_IF_MAYBE(protocol, getHeader(HEADER_SEC_WEBSOCKET_PROTOCOL)) {
       auto parts = split(*protocol, ',');
       auto list = builder.initProtocol(parts.size());
       for (auto i: kj::indices(parts)) {
@@ -341,121 +744,303 @@ public:
   }
 
 private:
-  struct Header {
-    kj::String name;
-    kj::String value;
+  enum TrackedHeader: uint {
+    // The headers the bridge actually consumes.  Everything else is discarded on arrival,
+    // unparsed and unallocated.
+    HEADER_NONE,
+    HEADER_SET_COOKIE,
+
+    // Headers with a stored value; these index `trackedValues`.
+    HEADER_CONTENT_DISPOSITION,
+    HEADER_CONTENT_ENCODING,
+    HEADER_CONTENT_LANGUAGE,
+    HEADER_CONTENT_TYPE,
+    HEADER_LOCATION,
+    HEADER_SEC_WEBSOCKET_PROTOCOL,
+
+    HEADER_FIRST_STORED = HEADER_CONTENT_DISPOSITION,
+    HEADER_STORED_COUNT = HEADER_SEC_WEBSOCKET_PROTOCOL - HEADER_FIRST_STORED + 1
   };
 
-  struct Cookie {
-    kj::String name;
-    kj::String value;
-    int64_t expires;
-
-    enum ExpirationType {
-      NONE, RELATIVE, ABSOLUTE
-    };
-    ExpirationType expirationType = NONE;
-
-    bool httpOnly = false;
+  struct View {
+    // A range of `arena`.  (Offsets, not pointers, since the arena can reallocate as it grows.)
+    uint32_t offset = 0;
+    uint32_t size = 0;
+    bool present = false;
   };
 
   http_parser_settings settings;
   kj::String statusString;
-  kj::String lastHeaderName;
-  std::map<kj::StringPtr, Header> headers;
+
+  kj::Vector<char> arena;
+  // Value bytes of tracked headers, in arrival order.  Values and cookies are stored as views
+  // into this one buffer and parsed in place; nothing is copied per header.
+
+  View trackedValues[HEADER_STORED_COUNT];
+  kj::Vector<View> cookieHeaders;
+
+  char nameBuf[32];
+  uint nameLen = 0;
+  bool nameTooLong = false;
+  // Accumulates the current header's name across (possibly split) on_header_field callbacks.
+  // Names longer than the buffer can't be tracked headers, so their bytes are dropped.
+
+  bool inValue = false;
+  uint currentHeader = HEADER_NONE;
+  uint32_t valueStart = 0;
+
   kj::Vector<char> body;
-  kj::Vector<Cookie> cookies;
+  bool sawData = false;
+  bool messageComplete = false;
+  bool shouldKeepAlive = false;
+
+  kj::Maybe<ByteStream::Client> responseStream;
+  // Stream to which we may forward the body, if the client offered one.
+
+  bool streaming = false;
+  // Set at headers-complete time if we decided to forward the body to `responseStream`.
+
+  uint64_t streamedBytes = 0;
+  // Body bytes forwarded to `responseStream` so far.
+
+  kj::Maybe<WebSession::Response::Builder> responseBuilder;
+  // Where the response will be built, if provided via setResponseBuilder().
 
-  kj::Maybe<kj::StringPtr> findHeader(kj::StringPtr name) {
-    auto iter = headers.find(name);
-    if (iter == headers.end()) {
+  bool direct = false;
+  // Set at headers-complete time if the response was built early and body bytes are being
+  // written directly into `directBody`.
+
+  capnp::Data::Builder directBody = nullptr;
+  uint64_t directBodyOffset = 0;
+
+  kj::Promise<void> writeQueue;
+  // Resolves when the response stream has acknowledged all write()s issued so far.
+
+  kj::Maybe<kj::ArrayPtr<const char>> getHeader(uint header) {
+    auto& slot = trackedValues[header - HEADER_FIRST_STORED];
+    if (!slot.present) {
       return nullptr;
-    } else {
-      return kj::StringPtr(iter->second.value);
     }
+    return arena.asPtr().slice(slot.offset, slot.offset + slot.size);
   }
 
-  void onStatus(kj::ArrayPtr<const char> status) {
-    statusString = kj::heapString(status);
+  uint classifyHeader() {
+    if (nameTooLong) return HEADER_NONE;
+    auto name = kj::arrayPtr(nameBuf, nameLen);
+    switch (headerKey(nameBuf, nameLen)) {
+      case KEY_SET_COOKIE:
+        return equalsIgnoreCase(name, "set-cookie") ? HEADER_SET_COOKIE : HEADER_NONE;
+      case KEY_CONTENT_DISPOSITION:
+        return equalsIgnoreCase(name, "content-disposition")
+            ? HEADER_CONTENT_DISPOSITION : HEADER_NONE;
+      case KEY_CONTENT_ENCODING:
+        return equalsIgnoreCase(name, "content-encoding") ? HEADER_CONTENT_ENCODING : HEADER_NONE;
+      case KEY_CONTENT_LANGUAGE:
+        return equalsIgnoreCase(name, "content-language") ? HEADER_CONTENT_LANGUAGE : HEADER_NONE;
+      case KEY_CONTENT_TYPE:
+        return equalsIgnoreCase(name, "content-type") ? HEADER_CONTENT_TYPE : HEADER_NONE;
+      case KEY_LOCATION:
+        return equalsIgnoreCase(name, "location") ? HEADER_LOCATION : HEADER_NONE;
+      case KEY_SEC_WEBSOCKET_PROTOCOL:
+        return equalsIgnoreCase(name, "sec-websocket-protocol")
+            ? HEADER_SEC_WEBSOCKET_PROTOCOL : HEADER_NONE;
+      default:
+        return HEADER_NONE;
+    }
   }
 
-  void onHeaderField(kj::ArrayPtr<const char> name) {
-    lastHeaderName = kj::heapString(name);
-    toLower(lastHeaderName);
+  void finalizeValue() {
+    // The value of the current header is complete (the parser moved on to the next header, or
+    // the headers ended).
+
+    if (!inValue) return;
+    inValue = false;
+
+    if (currentHeader == HEADER_NONE) return;
+
+    uint32_t size = arena.size() - valueStart;
+    if (currentHeader == HEADER_SET_COOKIE) {
+      cookieHeaders.add(View { valueStart, size, true });
+      return;
+    }
+
+    auto& slot = trackedValues[currentHeader - HEADER_FIRST_STORED];
+    if (slot.present) {
+      // Multiple instances of the same header are equivalent to comma-delimited.  Rare, so a
+      // copy into a fresh arena region is fine.
+      kj::Vector<char> merged(slot.size + size + 2);
+      merged.addAll(arena.asPtr().slice(slot.offset, slot.offset + slot.size));
+      merged.addAll(kj::StringPtr(", "));
+      merged.addAll(arena.asPtr().slice(valueStart, valueStart + size));
+
+      uint32_t offset = arena.size();
+      arena.addAll(merged);
+      slot = View { offset, (uint32_t)merged.size(), true };
+    } else {
+      slot = View { valueStart, size, true };
+    }
   }
 
-  void onHeaderValue(kj::ArrayPtr<const char> value) {
-    if (lastHeaderName == "set-cookie") {
-      // Really ugly cookie-parsing code.
-      // TODO(cleanup):  Clean up.
-      bool isFirst = true;
-      Cookie cookie;
-      for (auto part: split(value, ';')) {
-        if (isFirst) {
-          isFirst = false;
-          cookie.name = kj::heapString(trim(KJ_ASSERT_NONNULL(splitFirst(part, '='),
-              "Invalid cookie header from app.", value)));
-          cookie.value = kj::heapString(trim(part));
-        } else KJ_IF_MAYBE(name, splitFirst(part, '=')) {
-          auto prop = kj::heapString(trim(*name));
-          toLower(prop);
-          if (prop == "expires") {
-            auto value = kj::heapString(trim(part));
-            // Wed, 15 Nov 1995 06:25:24 GMT
-            struct tm t;
-            memset(&t, 0, sizeof(t));
-
-            // There are three allowed formats for HTTP dates.  Ugh.
-            char* end = strptime(value.cStr(), "%a, %d %b %Y %T GMT", &t);
-            if (end == nullptr) {
-              end = strptime(value.cStr(), "%a, %d-%b-%y %T GMT", &t);
-              if (end == nullptr) {
-                end = strptime(value.cStr(), "%a %b %d %T %Y", &t);
-              }
-            }
-            KJ_ASSERT(end != nullptr && *end == '\0', "Invalid HTTP date from app.", value);
-            cookie.expires = timegm(&t);
-            cookie.expirationType = Cookie::ExpirationType::ABSOLUTE;
-          } else if (prop == "max-age") {
-            auto value = kj::heapString(trim(part));
-            char* end;
-            cookie.expires = strtoull(value.cStr(), &end, 10);
-            KJ_ASSERT(end > value.begin() && *end == '\0', "Invalid cookie max-age app.", value);
-            cookie.expirationType = Cookie::ExpirationType::RELATIVE;
+  void buildCookie(kj::ArrayPtr<const char> text, WebSession::Cookie::Builder cookie) {
+    // Parse one Set-Cookie header, in place over the arena bytes -- no intermediate strings.
+    // (The `expires` union defaults to `none`.)
+
+    bool isFirst = true;
+    for (auto part: split(text, ';')) {
+      if (isFirst) {
+        isFirst = false;
+        auto name = trim(KJ_ASSERT_NONNULL(splitFirst(part, '='),
+            "Invalid cookie header from app.", kj::heapString(text.begin(), text.size())));
+        auto value = trim(part);
+        cookie.setName(capnp::Text::Reader(name.begin(), name.size()));
+        cookie.setValue(capnp::Text::Reader(value.begin(), value.size()));
+      } else KJ_IF_MAYBE(name, splitFirst(part, '=')) {
+        auto prop = trim(*name);
+        if (equalsIgnoreCase(prop, "expires")) {
+          auto value = trim(part);
+          KJ_IF_MAYBE(time, parseHttpDate(value)) {
+            cookie.getExpires().setAbsolute(*time);
           } else {
-            // Ignore other properties:
-            //   Path:  Not useful on the modern same-origin-policy web.
-            //   Domain:  We do not allow the app to publish cookies visible to other hosts in the
-            //     domain.
+            KJ_FAIL_ASSERT("Invalid HTTP date from app.",
+                           kj::heapString(value.begin(), value.size()));
           }
-        } else {
-          auto prop = kj::heapString(trim(part));
-          toLower(prop);
-          if (prop == "httponly") {
-            cookie.httpOnly = true;
-          } else {
-            // Ignore other properties:
-            //   Secure:  We always set this, since we always require https.
+        } else if (equalsIgnoreCase(prop, "max-age")) {
+          auto value = trim(part);
+          uint64_t seconds = 0;
+          bool sawDigit = false;
+          for (char c: value) {
+            KJ_ASSERT('0' <= c && c <= '9', "Invalid cookie max-age app.",
+                      kj::heapString(value.begin(), value.size()));
+            seconds = seconds * 10 + (c - '0');
+            sawDigit = true;
           }
+          KJ_ASSERT(sawDigit, "Invalid cookie max-age app.");
+          cookie.getExpires().setRelative(seconds);
+        } else {
+          // Ignore other properties:
+          //   Path:  Not useful on the modern same-origin-policy web.
+          //   Domain:  We do not allow the app to publish cookies visible to other hosts in the
+          //     domain.
+        }
+      } else {
+        auto prop = trim(part);
+        if (equalsIgnoreCase(prop, "httponly")) {
+          cookie.setHttpOnly(true);
+        } else {
+          // Ignore other properties:
+          //   Secure:  We always set this, since we always require https.
         }
       }
+    }
+  }
 
-      cookies.add(kj::mv(cookie));
+  void onStatus(kj::ArrayPtr<const char> status) {
+    statusString = kj::heapString(status);
+  }
 
-    } else {
-      kj::StringPtr name = lastHeaderName;
-      auto& slot = headers[name];
-      if (slot.name != nullptr) {
-        // Multiple instances of the same header are equivalent to comma-delimited.
-        slot.value = kj::str(kj::mv(slot.value), ", ", value);
+  void onHeaderField(kj::ArrayPtr<const char> name) {
+    if (inValue) {
+      // Starting a new header.
+      finalizeValue();
+      nameLen = 0;
+      nameTooLong = false;
+    }
+
+    for (char c: name) {
+      if (nameLen < sizeof(nameBuf)) {
+        nameBuf[nameLen++] = c;
       } else {
-        slot = Header { kj::mv(lastHeaderName), kj::heapString(value) };
+        nameTooLong = true;
+      }
+    }
+  }
+
+  void onHeaderValue(kj::ArrayPtr<const char> value) {
+    if (!inValue) {
+      // First chunk of this header's value:  decide whether we care about it at all.
+      currentHeader = classifyHeader();
+      inValue = true;
+      valueStart = arena.size();
+    }
+
+    if (currentHeader != HEADER_NONE) {
+      arena.addAll(value);
+    }
+    // Untracked headers cost nothing:  no allocation, no copy, no lookup.
+  }
+
+  void onHeadersComplete() {
+    // Close out the final header before anything below looks at the collected values.
+    finalizeValue();
+
+    KJ_IF_MAYBE(stream, responseStream) {
+      // Only 2xx content responses have bodies worth streaming; redirects and error pages are
+      // small and need to be embedded in the response message anyway.
+      auto iter = HTTP_STATUS_CODES.find(status_code);
+      if (iter != HTTP_STATUS_CODES.end() &&
+          iter->second.type == WebSession::Response::CONTENT) {
+        streaming = true;
+
+        if (content_length != ULLONG_MAX) {
+          auto req = stream->expectSizeRequest(capnp::MessageSize {4, 0});
+          req.setSize(content_length);
+          auto promise = req.send().then([](auto response) {});
+          writeQueue = writeQueue.then([KJ_MVCAP(promise)]() mutable {
+            return kj::mv(promise);
+          });
+        }
+      }
+    }
+
+    if (!streaming) {
+      KJ_IF_MAYBE(builder, responseBuilder) {
+        // All the header-derived fields are known now.  For a content response with a declared
+        // length, build the whole response immediately so that body bytes can land directly in
+        // the message as they arrive.  (Chunked and EOF-delimited bodies still buffer, since we
+        // can't size the Data segment up front.)
+        auto iter = HTTP_STATUS_CODES.find(status_code);
+        if (iter != HTTP_STATUS_CODES.end() &&
+            iter->second.type == WebSession::Response::CONTENT &&
+            content_length != ULLONG_MAX && !upgrade) {
+          direct = true;
+          buildImpl(*builder);
+        }
       }
     }
   }
 
   void onBody(kj::ArrayPtr<const char> data) {
-    body.addAll(data);
+    if (direct) {
+      KJ_ASSERT(directBodyOffset + data.size() <= directBody.size(),
+                "Sandboxed app sent more body data than its Content-Length.");
+      memcpy(directBody.begin() + directBodyOffset, data.begin(), data.size());
+      directBodyOffset += data.size();
+      return;
+    }
+
+    if (streaming) {
+      sendBodyBytes(kj::arrayPtr(reinterpret_cast<const byte*>(data.begin()), data.size()));
+    } else {
+      body.addAll(data);
+    }
+  }
+
+  void onMessageComplete() {
+    messageComplete = true;
+    shouldKeepAlive = http_should_keep_alive(this) != 0;
+
+    // Stop parsing here so that feed() can detect unsolicited extra data.
+    http_parser_pause(this, 1);
+  }
+
+  static int on_message_complete(http_parser* p) {
+    static_cast<HttpParser*>(p)->onMessageComplete();
+    return 0;
+  }
+
+  static int on_headers_complete(http_parser* p) {
+    static_cast<HttpParser*>(p)->onHeadersComplete();
+    return 0;
   }
 
 #define ON_C(lower, title) \
@@ -471,32 +1056,6 @@ private:
 #undef ON_C
 };
 
-kj::Promise<kj::Vector<char>> readAll(kj::AsyncIoStream& stream, kj::Vector<char>&& buffer) {
-  // TODO(perf):  Optimize Vector<char> to avoid per-element destructor calls.
-
-  size_t offset = buffer.size();
-  buffer.resize(kj::max(offset * 2, 4096));
-  size_t expected = buffer.size() - offset;
-  auto promise = stream.tryRead(buffer.begin() + offset, expected, expected);
-  return promise.then(
-      [&stream, offset, expected, KJ_MVCAP(buffer)](size_t actual) mutable
-      -> kj::Promise<kj::Vector<char>> {
-    if (actual < expected) {
-      // Got less than expected; must be EOF.
-      buffer.resize(offset + actual);
-      return kj::mv(buffer);
-    } else {
-      // Sill going; read more.
-      return readAll(stream, kj::mv(buffer));
-    }
-  });
-}
-
-kj::Promise<kj::Vector<char>> readAll(kj::Own<kj::AsyncIoStream>&& stream) {
-  auto& streamRef = *stream;
-  return readAll(streamRef, kj::Vector<char>()).attach(kj::mv(stream));
-}
-
 struct ResponseHeaders {
   kj::Vector<char> headers;
   kj::Array<byte> firstData;
@@ -562,36 +1121,128 @@ kj::Promise<ResponseHeaders> readResponseHeaders(kj::AsyncIoStream& stream) {
   return readResponseHeaders(stream, kj::Vector<char>());
 }
 
+kj::Promise<void> readResponse(kj::AsyncIoStream& stream, HttpParser& parser) {
+  // Read from `stream`, feeding `parser`, until the parser has seen a complete response, has
+  // decided to stream the body (in which case the rest of the read loop is the pump's job), or
+  // the stream hits EOF.  (On EOF, it is up to the caller to notify the parser via build().)
+
+  auto buffer = kj::heapArray<char>(4096);
+  auto promise = stream.tryRead(buffer.begin(), 1, buffer.size());
+  return promise.then(
+      [&stream, &parser, KJ_MVCAP(buffer)](size_t actual) mutable -> kj::Promise<void> {
+    if (actual == 0) {
+      // EOF.
+      return kj::READY_NOW;
+    }
+
+    parser.feed(kj::arrayPtr(buffer.begin(), actual));
+    if (parser.isComplete() || parser.isStreaming()) {
+      return kj::READY_NOW;
+    }
+
+    return readResponse(stream, parser);
+  });
+}
+
+class ConnectionPool {
+  // Maintains a set of idle keep-alive connections to the app's HTTP server, so that consecutive
+  // requests need not each pay for a fresh TCP handshake.  The app may close an idle connection
+  // at any time, so callers must be prepared to retry on a fresh connection; see
+  // Connection::isFresh.
+
+public:
+  explicit ConnectionPool(kj::NetworkAddress& serverAddr): serverAddr(serverAddr) {}
+
+  struct Connection {
+    kj::Own<kj::AsyncIoStream> stream;
+    bool isFresh;
+    // If false, this connection already carried at least one request, and may turn out to have
+    // been closed by the app in the meantime.
+  };
+
+  kj::Promise<Connection> getConnection() {
+    if (idle.size() > 0) {
+      auto stream = kj::mv(idle[idle.size() - 1]);
+      idle.resize(idle.size() - 1);
+      return Connection { kj::mv(stream), false };
+    }
+
+    return getFreshConnection();
+  }
+
+  kj::Promise<Connection> getFreshConnection() {
+    // Get a connection which is guaranteed not to have been closed by the app, e.g. to retry a
+    // request that failed on a pooled connection.
+
+    return serverAddr.connect().then([](kj::Own<kj::AsyncIoStream>&& stream) {
+      return Connection { kj::mv(stream), true };
+    });
+  }
+
+  void returnConnection(kj::Own<kj::AsyncIoStream> stream) {
+    if (idle.size() < MAX_IDLE_CONNECTIONS) {
+      idle.add(kj::mv(stream));
+    }
+    // Otherwise just drop it; we have enough warm connections already.
+  }
+
+private:
+  static constexpr uint MAX_IDLE_CONNECTIONS = 4;
+  // Dozens of concurrent requests per page render are typical, but they complete quickly; a small
+  // number of warm connections is enough to absorb the bursts without holding sockets open in the
+  // app indefinitely.
+
+  kj::NetworkAddress& serverAddr;
+  kj::Vector<kj::Own<kj::AsyncIoStream>> idle;
+};
+
+constexpr uint ConnectionPool::MAX_IDLE_CONNECTIONS;
+
 class WebSocketPump final: public WebSession::WebSocketStream::Server,
                            private kj::TaskSet::ErrorHandler {
 public:
   WebSocketPump(kj::Own<kj::AsyncIoStream> serverStream,
-                WebSession::WebSocketStream::Client clientStream)
+                WebSession::WebSocketStream::Client clientStream,
+                BridgeMetrics& metrics)
       : serverStream(kj::mv(serverStream)),
         clientStream(kj::mv(clientStream)),
+        metrics(metrics),
+        readBuffer(kj::heapArray<byte>(INITIAL_READ_SIZE)),
         upstreamOp(kj::READY_NOW),
         tasks(*this) {}
 
   void pump() {
     // Repeatedly read from serverStream and write to clientStream.
-    tasks.add(serverStream->tryRead(buffer, 1, sizeof(buffer))
+    tasks.add(serverStream->tryRead(readBuffer.begin(), 1, readBuffer.size())
         .then([this](size_t amount) {
       if (amount > 0) {
-        sendData(kj::arrayPtr(buffer, amount));
+        sendData(kj::arrayPtr(readBuffer.begin(), amount));
+
+        if (amount == readBuffer.size() && readBuffer.size() < MAX_READ_SIZE) {
+          // The socket is hot -- the kernel had at least a full buffer waiting for us.  Grow the
+          // read window so a busy app can hand over more bytes per read.
+          readBuffer = kj::heapArray<byte>(readBuffer.size() * 2);
+        }
+
         pump();
       } else {
-        // EOF.
+        // EOF.  Flush anything still buffered, then drop the client stream.
+        flushPending();
         clientStream = nullptr;
       }
     }));
   }
 
-  void sendData(kj::ArrayPtr<byte> data) {
-    // Write the given bytes to clientStream.
-    auto request = clientStream.sendBytesRequest(
-        capnp::MessageSize { data.size() / sizeof(capnp::word) + 8, 0 });
-    request.setMessage(data);
-    tasks.add(request.send().then([](auto response) {}));
+  void sendData(kj::ArrayPtr<const byte> data) {
+    // Queue the given bytes to be written to clientStream, coalescing consecutive writes into a
+    // single sendBytes() call where possible:  while a previous call is in flight, newly read
+    // bytes accumulate in `pending` and go out as one batch when the call completes.  An idle
+    // connection thus still sends small frames immediately, while a busy one sends large batches
+    // instead of one RPC round trip per read.
+    pending.addAll(data);
+    if (sendsInFlight == 0 || pending.size() >= FLUSH_THRESHOLD) {
+      flushPending();
+    }
   }
 
 protected:
@@ -606,8 +1257,29 @@ protected:
   }
 
 private:
+  static constexpr size_t INITIAL_READ_SIZE = 4096;
+  static constexpr size_t MAX_READ_SIZE = 65536;
+  // The read window starts small and doubles whenever a read fills it completely, so that a
+  // chatty-but-light connection doesn't pin a big buffer while a busy one isn't limited to 4k
+  // per syscall.
+
+  static constexpr size_t FLUSH_THRESHOLD = 65536;
+  // If this many bytes accumulate while a sendBytes() call is still in flight, send another batch
+  // immediately rather than letting the backlog grow without bound.  Cap'n Proto guarantees
+  // calls on the same capability are delivered in order, so overlapping calls are safe.
+
   kj::Own<kj::AsyncIoStream> serverStream;
   WebSession::WebSocketStream::Client clientStream;
+  BridgeMetrics& metrics;
+
+  kj::Array<byte> readBuffer;
+  // Buffer for reads from serverStream; see INITIAL_READ_SIZE.
+
+  kj::Vector<byte> pending;
+  // Bytes read from serverStream but not yet passed to a sendBytes() call.
+
+  uint sendsInFlight = 0;
+  // Number of sendBytes() calls issued but not yet acknowledged.
 
   kj::Promise<void> upstreamOp;
   // The promise working on writing data to serverStream.  AsyncIoStream wants only one write() at
@@ -616,7 +1288,23 @@ private:
   kj::TaskSet tasks;
   // Pending calls to clientStream.sendBytes() and serverStream.read().
 
-  byte buffer[4096];
+  void flushPending() {
+    if (pending.size() == 0) return;
+
+    auto request = clientStream.sendBytesRequest(
+        capnp::MessageSize { pending.size() / sizeof(capnp::word) + 8, 0 });
+    request.setMessage(kj::arrayPtr(pending.begin(), pending.size()));
+    metrics.recordWebSocketSend(pending.size());
+    pending.resize(0);
+
+    ++sendsInFlight;
+    tasks.add(request.send().then([this](auto response) {
+      --sendsInFlight;
+
+      // Send whatever accumulated while this call was in flight.
+      flushPending();
+    }));
+  }
 
   void taskFailed(kj::Exception&& exception) override {
     // TODO(soon):  What do we do when a server -> client send throws?  Probably just ignore it;
@@ -627,31 +1315,445 @@ private:
   }
 };
 
+constexpr size_t WebSocketPump::INITIAL_READ_SIZE;
+constexpr size_t WebSocketPump::MAX_READ_SIZE;
+constexpr size_t WebSocketPump::FLUSH_THRESHOLD;
+
+class ResponseStreamPump final: public Handle::Server,
+                                private kj::TaskSet::ErrorHandler {
+  // Pumps the remainder of a streamed HTTP response body from the app to the client's response
+  // stream.  Doubles as the handle capability returned in the response's `body.stream`:  if the
+  // client drops it, the pump is canceled and the connection to the app is closed.
+
+public:
+  ResponseStreamPump(kj::Own<kj::AsyncIoStream> serverStream, kj::Own<HttpParser> parser)
+      : serverStream(kj::mv(serverStream)), parser(kj::mv(parser)), tasks(*this) {}
+
+  void pump() {
+    if (parser->isComplete()) {
+      // The whole body happened to arrive along with the headers.
+      tasks.add(parser->finishStreaming());
+      return;
+    }
+
+    KJ_IF_MAYBE(remaining, parser->identityBodyRemaining()) {
+      // The rest of the body is a plain run of exactly *remaining bytes -- no framing left to
+      // parse -- so move it in large blocks without involving the HTTP parser at all.  (A true
+      // splice of the app socket through to the client isn't possible across a Cap'n Proto
+      // boundary, which has no way to carry raw descriptors; parser-free block transfer is the
+      // available approximation.)
+      tasks.add(rawPumpLoop(*remaining));
+      return;
+    }
+
+    tasks.add(pumpLoop());
+  }
+
+private:
+  kj::Own<kj::AsyncIoStream> serverStream;
+  kj::Own<HttpParser> parser;
+
+  kj::TaskSet tasks;
+  // The running pump.
+
+  static constexpr size_t RAW_PUMP_BUFFER_SIZE = 262144;
+  // Block size for the parser-free path.  Large downloads move in quarter-megabyte reads and
+  // writes instead of 4k parser feeds.
+
+  kj::Promise<void> rawPumpLoop(uint64_t remaining) {
+    auto buffer = kj::heapArray<byte>(
+        kj::min(remaining, (uint64_t)RAW_PUMP_BUFFER_SIZE));
+    auto promise = serverStream->tryRead(buffer.begin(), 1, buffer.size());
+    return promise.then(
+        [this, KJ_MVCAP(buffer), remaining](size_t actual) mutable -> kj::Promise<void> {
+      KJ_ASSERT(actual > 0, "Sandboxed app closed connection mid-response.");
+
+      parser->sendBodyBytes(kj::arrayPtr(buffer.begin(), actual));
+
+      uint64_t newRemaining = remaining - actual;
+      if (newRemaining == 0) {
+        return parser->finishStreaming();
+      }
+
+      return parser->flushStreamingWrites().then([this, newRemaining]() {
+        return rawPumpLoop(newRemaining);
+      });
+    });
+  }
+
+  kj::Promise<void> pumpLoop() {
+    auto buffer = kj::heapArray<char>(4096);
+    auto promise = serverStream->tryRead(buffer.begin(), 1, buffer.size());
+    return promise.then([this, KJ_MVCAP(buffer)](size_t actual) mutable -> kj::Promise<void> {
+      if (actual == 0) {
+        // EOF.  Let the parser know, in case the body was EOF-delimited.
+        parser->feed(nullptr);
+        KJ_ASSERT(parser->isComplete(), "Sandboxed app closed connection mid-response.");
+        return parser->finishStreaming();
+      }
+
+      parser->feed(kj::arrayPtr(buffer.begin(), actual));
+      if (parser->isComplete()) {
+        return parser->finishStreaming();
+      }
+
+      return parser->flushStreamingWrites().then([this]() { return pumpLoop(); });
+    });
+  }
+
+  void taskFailed(kj::Exception&& exception) override {
+    // The response was already returned to the client by the time the pump started, so there is
+    // no way to report this error other than logging it and aborting the stream.
+    KJ_LOG(ERROR, exception);
+    parser->abortStreaming();
+  }
+};
+
+constexpr size_t ResponseStreamPump::RAW_PUMP_BUFFER_SIZE;
+
+kj::Promise<void> doHttpRequest(ConnectionPool& pool, BridgeMetrics& metrics,
+                                kj::Own<kj::AsyncIoStream> stream,
+                                kj::ArrayPtr<const byte> httpRequest,
+                                kj::Own<HttpParser> parser,
+                                WebSession::Response::Builder results) {
+  // One attempt at `httpRequest` on the given connection.  `results` may be filled in
+  // incrementally while the response streams in (see HttpParser::setResponseBuilder()); the
+  // message that owns it must stay alive until the returned promise resolves.
+
+  parser->setResponseBuilder(results);
+
+  auto& streamRef = *stream;
+  auto& parserRef = *parser;
+  return streamRef.write(httpRequest.begin(), httpRequest.size())
+      .then([&streamRef, &parserRef]() {
+    // Note:  Do not do stream->shutdownWrite() as some HTTP servers will decide to close the
+    // socket immediately on EOF, even if they have not actually responded to previous requests
+    // yet.
+    return readResponse(streamRef, parserRef);
+  }).then([&pool, &metrics, KJ_MVCAP(stream), KJ_MVCAP(parser), results]() mutable {
+    KJ_ASSERT(parser->sawAnyData(), "Sandboxed server returned no data.");
+    parser->build(results);
+    metrics.recordBodySize(parser->bodySize());
+    if (parser->isStreaming()) {
+      // The body goes out via the client's response stream.  Hand the connection and parser
+      // off to a pump, which doubles as the cancellation handle.  Streamed connections are not
+      // returned to the pool; they are typically long downloads, and the pump owns the socket
+      // until the response completes.
+      auto pump = kj::heap<ResponseStreamPump>(kj::mv(stream), kj::mv(parser));
+      pump->pump();
+      results.getContent().getBody().setStream(kj::mv(pump));
+    } else if (parser->canReuseConnection()) {
+      pool.returnConnection(kj::mv(stream));
+    }
+  });
+}
+
+kj::Promise<void> performHttpRequest(ConnectionPool& pool, BridgeMetrics& metrics,
+                                     kj::ArrayPtr<const byte> httpRequest,
+                                     kj::Maybe<ByteStream::Client> responseStream,
+                                     WebSession::Response::Builder results) {
+  // Send `httpRequest` to the app on a pooled connection and build the response into `results`.
+  // The caller must keep the request bytes and the message owning `results` alive until the
+  // returned promise resolves.
+
+  uint64_t startNs = nowNanos();
+
+  return pool.getConnection().then(
+      [&pool, &metrics, httpRequest, KJ_MVCAP(responseStream), results]
+      (ConnectionPool::Connection&& conn) mutable -> kj::Promise<void> {
+    metrics.recordConnection(conn.isFresh);
+    auto parser = kj::refcounted<HttpParser>(responseStream);
+    auto& parserRef = *parser;
+    bool isFresh = conn.isFresh;
+    auto promise = doHttpRequest(pool, metrics, kj::mv(conn.stream), httpRequest,
+                                 kj::addRef(parserRef), results);
+    if (isFresh) {
+      return promise.attach(kj::mv(parser));
+    }
+
+    // The app may close pooled connections while they sit idle.  If that is what happened --
+    // i.e. the attempt failed before any response data arrived -- then the app never actually
+    // processed the request, so we can safely retry it on a fresh connection.
+    return promise.then([]() -> kj::Promise<void> { return kj::READY_NOW; },
+        [&pool, &metrics, &parserRef, httpRequest, KJ_MVCAP(responseStream), results]
+        (kj::Exception&& exception) mutable -> kj::Promise<void> {
+      if (parserRef.sawAnyData()) {
+        // The app started responding before the failure.  It may have had side effects, so
+        // retrying would not be safe.
+        kj::throwFatalException(kj::mv(exception));
+      }
+      return pool.getFreshConnection().then(
+          [&pool, &metrics, httpRequest, KJ_MVCAP(responseStream), results]
+          (ConnectionPool::Connection&& conn) mutable {
+        metrics.recordConnection(true);
+        return doHttpRequest(pool, metrics, kj::mv(conn.stream), httpRequest,
+                             kj::refcounted<HttpParser>(kj::mv(responseStream)), results);
+      });
+    }).attach(kj::mv(parser));
+  }).then([&metrics, startNs]() {
+    metrics.recordRequest(nowNanos() - startNs);
+  }, [&metrics](kj::Exception&& exception) {
+    metrics.recordError();
+    kj::throwFatalException(kj::mv(exception));
+  });
+}
+
+class WorkerPool {
+  // Shards HTTP request handling across worker threads, each running its own KJ event loop with
+  // its own keep-alive connection pool to the app, so that a grain serving many concurrent
+  // requests isn't limited to one core.  The Cap'n Proto connection to the supervisor stays on
+  // the main thread -- a TwoPartyVatNetwork is strictly single-threaded -- so workers receive
+  // fully-rendered HTTP request bytes and hand back fully-built Response messages.  Each
+  // direction of the handoff is a locked queue plus an eventfd wakeup.
+  //
+  // Requests with a response stream, and WebSockets, interact with capabilities belonging to the
+  // main thread's RPC system, so those stay on the main thread; see WebSessionImpl.
+
+public:
+  WorkerPool(kj::AsyncIoContext& io, kj::StringPtr addressStr, uint count,
+             MetricsRegistry& metricsRegistry)
+      : tasks(errorHandler) {
+    int efd;
+    KJ_SYSCALL(efd = eventfd(0, EFD_CLOEXEC));
+    completionFd = kj::AutoCloseFd(efd);
+    completionStream = io.lowLevelProvider->wrapInputFd(completionFd.get());
+
+    tasks.add(pumpCompletions());
+
+    for (uint i = 0; i < count; i++) {
+      // Each worker gets its own metrics block, registered before the thread starts.
+      workers.add(kj::heap<Worker>(*this, addressStr, metricsRegistry.add()));
+    }
+  }
+
+  struct Job {
+    // A request in flight between the main thread and a worker.  Allocated by the main thread,
+    // filled in by the worker, then completed and freed by the main thread; the queues hand off
+    // exclusive ownership, so no locking is needed beyond the queues themselves.
+
+    kj::Array<byte> httpRequest;
+    kj::Own<capnp::MallocMessageBuilder> response;  // Filled in by the worker on success.
+    kj::Maybe<kj::Exception> error;                 // Filled in by the worker on failure.
+    kj::Own<kj::PromiseFulfiller<kj::Own<capnp::MallocMessageBuilder>>> fulfiller;
+  };
+
+  class Worker {
+  public:
+    Worker(WorkerPool& pool, kj::StringPtr addressStr, BridgeMetrics& metrics)
+        : pool(pool), addressStr(kj::heapString(addressStr)), metrics(metrics) {
+      int efd;
+      KJ_SYSCALL(efd = eventfd(0, EFD_CLOEXEC));
+      wakeFd = kj::AutoCloseFd(efd);
+      thread = kj::heap<kj::Thread>([this]() { run(); });
+    }
+
+    ~Worker() {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        shutdown = true;
+      }
+      wake();
+      // `thread`'s destructor joins.
+    }
+
+    kj::Promise<kj::Own<capnp::MallocMessageBuilder>> sendRequest(kj::Array<byte> httpRequest) {
+      // Called on the main thread:  queue the request for this worker and return a promise for
+      // the response message.
+
+      auto paf = kj::newPromiseAndFulfiller<kj::Own<capnp::MallocMessageBuilder>>();
+
+      auto job = new Job;
+      job->httpRequest = kj::mv(httpRequest);
+      job->fulfiller = kj::mv(paf.fulfiller);
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        queue.push_back(job);
+      }
+      wake();
+
+      return kj::mv(paf.promise);
+    }
+
+  private:
+    WorkerPool& pool;
+    kj::String addressStr;
+    BridgeMetrics& metrics;
+    kj::AutoCloseFd wakeFd;
+
+    std::mutex mutex;
+    std::deque<Job*> queue;
+    bool shutdown = false;
+
+    kj::Own<kj::Thread> thread;
+    // Must be the last member, so that the thread can't start before the rest is initialized.
+
+    void wake() {
+      uint64_t one = 1;
+      KJ_SYSCALL(write(wakeFd, &one, sizeof(one)));
+    }
+
+    void run() {
+      // Thread main.
+
+      auto io = kj::setupAsyncIo();
+      auto address = io.provider->getNetwork().parseAddress(addressStr).wait(io.waitScope);
+      ConnectionPool connPool(*address);
+
+      auto wakeStream = io.lowLevelProvider->wrapInputFd(wakeFd.get());
+
+      class ErrorHandlerImpl: public kj::TaskSet::ErrorHandler {
+      public:
+        void taskFailed(kj::Exception&& exception) override {
+          // Can't happen:  handleJob() captures all errors into the job.
+          KJ_LOG(ERROR, exception);
+        }
+      };
+      ErrorHandlerImpl errorHandler;
+      kj::TaskSet jobTasks(errorHandler);
+
+      uint64_t wakeCount;
+      for (;;) {
+        // In-flight jobs make progress while we wait here, since wait() runs this thread's
+        // event loop.
+        wakeStream->read(&wakeCount, sizeof(wakeCount)).wait(io.waitScope);
+
+        kj::Vector<Job*> batch;
+        bool stop;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          while (!queue.empty()) {
+            batch.add(queue.front());
+            queue.pop_front();
+          }
+          stop = shutdown;
+        }
+
+        for (Job* job: batch) {
+          jobTasks.add(handleJob(connPool, job));
+        }
+
+        if (stop) {
+          // Only happens at process exit; any in-flight jobs are abandoned.
+          return;
+        }
+      }
+    }
+
+    kj::Promise<void> handleJob(ConnectionPool& connPool, Job* job) {
+      job->response = kj::heap<capnp::MallocMessageBuilder>();
+      kj::ArrayPtr<const byte> requestRef = job->httpRequest;
+
+      return performHttpRequest(connPool, metrics, requestRef, nullptr,
+                                job->response->getRoot<WebSession::Response>())
+          .then([]() {},
+                [job](kj::Exception&& exception) { job->error = kj::mv(exception); })
+          .then([this, job]() { pool.completeJob(job); });
+    }
+  };
+
+  Worker& next() {
+    // Round-robin assignment; sessions stick with the worker they're given.
+    auto& result = *workers[nextWorker];
+    nextWorker = (nextWorker + 1) % workers.size();
+    return result;
+  }
+
+private:
+  kj::AutoCloseFd completionFd;
+  kj::Own<kj::AsyncInputStream> completionStream;
+  uint64_t completionCount = 0;
+
+  std::mutex completionMutex;
+  std::deque<Job*> completions;
+
+  kj::Vector<kj::Own<Worker>> workers;
+  uint nextWorker = 0;
+
+  class TaskErrorHandler: public kj::TaskSet::ErrorHandler {
+  public:
+    void taskFailed(kj::Exception&& exception) override {
+      KJ_LOG(ERROR, "worker completion pump failed", exception);
+    }
+  };
+  TaskErrorHandler errorHandler;
+  kj::TaskSet tasks;
+
+  void completeJob(Job* job) {
+    // Called on a worker thread:  hand the finished job back to the main thread.
+
+    {
+      std::unique_lock<std::mutex> lock(completionMutex);
+      completions.push_back(job);
+    }
+    uint64_t one = 1;
+    KJ_SYSCALL(write(completionFd, &one, sizeof(one)));
+  }
+
+  kj::Promise<void> pumpCompletions() {
+    // Main-thread loop fulfilling the promises of finished jobs.
+
+    return completionStream->read(&completionCount, sizeof(completionCount)).then([this]() {
+      kj::Vector<Job*> batch;
+      {
+        std::unique_lock<std::mutex> lock(completionMutex);
+        while (!completions.empty()) {
+          batch.add(completions.front());
+          completions.pop_front();
+        }
+      }
+
+      for (Job* job: batch) {
+        KJ_IF_MAYBE(exception, job->error) {
+          job->fulfiller->reject(kj::mv(*exception));
+        } else {
+          job->fulfiller->fulfill(kj::mv(job->response));
+        }
+        delete job;
+      }
+
+      return pumpCompletions();
+    });
+  }
+};
+
 class WebSessionImpl final: public WebSession::Server {
 public:
-  WebSessionImpl(kj::NetworkAddress& serverAddr,
+  WebSessionImpl(ConnectionPool& pool, BridgeMetrics& metrics,
+                 kj::Maybe<WorkerPool::Worker&> worker,
                  UserInfo::Reader userInfo, SessionContext::Client context,
                  WebSession::Params::Reader params)
-      : serverAddr(serverAddr),
-        context(kj::mv(context)),
-        userDisplayName(kj::heapString(userInfo.getDisplayName().getDefaultText())),
-        basePath(kj::heapString(params.getBasePath())),
-        userAgent(kj::heapString(params.getUserAgent())),
-        acceptLanguages(kj::strArray(params.getAcceptableLanguages(), ",")) {}
+      : pool(pool),
+        metrics(metrics),
+        worker(worker),
+        context(kj::mv(context)) {
+    // Pre-render the header blocks that are fixed for this session's lifetime, so that the
+    // per-request path only splices in the request line, content headers, and cookies instead
+    // of building fifteen-odd strings per request.
+    sessionHeaders = kj::str(
+        "Host: sandbox\r\n"
+        "User-Agent: ", params.getUserAgent(), "\r\n"
+        "X-Sandstorm-Username: ", userInfo.getDisplayName().getDefaultText(), "\r\n"
+        "X-Sandstorm-Base-Path: ", params.getBasePath(), "\r\n");
+    fixedHeaders = kj::str(
+        "Connection: keep-alive\r\n"
+        "Accept: */*\r\n"
+        "Accept-Encoding: gzip\r\n"
+        "Accept-Language: ", kj::strArray(params.getAcceptableLanguages(), ","), "\r\n",
+        sessionHeaders);
+  }
 
   kj::Promise<void> get(GetContext context) override {
     GetParams::Reader params = context.getParams();
-    kj::String httpRequest = makeHeaders("GET", params.getPath(), params.getContext());
-    return sendRequest(toBytes(httpRequest), context);
+    return sendRequest(renderRequest("GET", params.getPath(), params.getContext(), nullptr),
+                       getResponseStream(params.getContext()), context);
   }
 
   kj::Promise<void> post(PostContext context) override {
     PostParams::Reader params = context.getParams();
-    auto content = params.getContent();
-    kj::String httpRequest = makeHeaders("POST", params.getPath(), params.getContext(),
-      kj::str("Content-Type: ", content.getMimeType()),
-      kj::str("Content-Length: ", content.getContent().size()));
-    return sendRequest(toBytes(httpRequest, content.getContent()), context);
+    return sendRequest(
+        renderRequest("POST", params.getPath(), params.getContext(), params.getContent()),
+        getResponseStream(params.getContext()), context);
   }
 
   kj::Promise<void> openWebSocket(OpenWebSocketContext context) override {
@@ -660,41 +1762,33 @@ public:
 
     auto params = context.getParams();
 
-    kj::Vector<kj::String> lines(16);
-
-    lines.add(kj::str("GET /", params.getPath(), " HTTP/1.1"));
-    lines.add(kj::str("Upgrade: websocket"));
-    lines.add(kj::str("Connection: Upgrade"));
-    lines.add(kj::str("Sec-WebSocket-Key: mj9i153gxeYNlGDoKdoXOQ=="));
-    auto protocols = params.getProtocol();
-    if (protocols.size() > 0) {
-      lines.add(kj::str("Sec-WebSocket-Protocol: ", kj::strArray(params.getProtocol(), ", ")));
-    }
-    lines.add(kj::str("Sec-WebSocket-Version: 13"));
-
-    addCommonHeaders(lines, params.getContext());
-
-    auto httpRequest = toBytes(kj::strArray(lines, "\r\n"));
+    auto httpRequest = renderWebSocketRequest(params.getPath(), params.getProtocol(),
+                                              params.getContext());
     WebSession::WebSocketStream::Client clientStream = params.getClientStream();
 
     context.releaseParams();
-    return serverAddr.connect().then(
-        [KJ_MVCAP(httpRequest), KJ_MVCAP(clientStream), context]
-        (kj::Own<kj::AsyncIoStream>&& stream) mutable {
+
+    // WebSockets take over their connection permanently, so always use a fresh one rather than
+    // drawing down the keep-alive pool.
+    return pool.getFreshConnection().then(
+        [this, KJ_MVCAP(httpRequest), KJ_MVCAP(clientStream), context]
+        (ConnectionPool::Connection&& conn) mutable {
+      auto stream = kj::mv(conn.stream);
       kj::ArrayPtr<const byte> httpRequestRef = httpRequest;
       auto& streamRef = *stream;
       return streamRef.write(httpRequestRef.begin(), httpRequestRef.size())
           .attach(kj::mv(httpRequest))
           .then([&streamRef]() { return readResponseHeaders(streamRef); })
-          .then([KJ_MVCAP(stream), KJ_MVCAP(clientStream), context]
+          .then([this, KJ_MVCAP(stream), KJ_MVCAP(clientStream), context]
                 (ResponseHeaders&& headers) mutable {
             KJ_ASSERT(headers.headers.size() > 0, "Sandboxed server returned no data.");
-            HttpParser parser;
-            parser.parse(headers.headers);
+            auto parser = kj::refcounted<HttpParser>();
+            parser->parse(headers.headers);
             auto results = context.getResults();
-            parser.buildForWebSocket(results);
+            parser->buildForWebSocket(results);
 
-            auto pump = kj::heap<WebSocketPump>(kj::mv(stream), kj::mv(clientStream));
+            auto pump = kj::heap<WebSocketPump>(kj::mv(stream), kj::mv(clientStream),
+                                                metrics);
 
             if (headers.firstData.size() > 0) {
               pump->sendData(headers.firstData);
@@ -707,88 +1801,156 @@ public:
   }
 
 private:
-  kj::NetworkAddress& serverAddr;
+  ConnectionPool& pool;
+  BridgeMetrics& metrics;
+  kj::Maybe<WorkerPool::Worker&> worker;
+  // If non-null, buffered requests are handed off to this worker thread; the session sticks
+  // with one worker so its requests stay ordered relative to each other.
+
   SessionContext::Client context;
-  kj::String userDisplayName;
-  kj::String basePath;
-  kj::String userAgent;
-  kj::String acceptLanguages;
 
-  kj::String makeHeaders(kj::StringPtr method, kj::StringPtr path,
-                         WebSession::Context::Reader context,
-                         kj::String extraHeader1 = nullptr,
-                         kj::String extraHeader2 = nullptr) {
-    kj::Vector<kj::String> lines(16);
+  kj::String fixedHeaders;
+  // Per-session-constant header block for ordinary requests (connection, accepts, host, user
+  // agent, username, base path), pre-rendered with trailing CRLFs.
+
+  kj::String sessionHeaders;
+  // The subset of fixedHeaders that also applies to WebSocket upgrade requests (which carry
+  // their own Connection header).
+
+  static void append(kj::Vector<byte>& out, kj::StringPtr text) {
+    out.addAll(kj::ArrayPtr<const byte>(
+        reinterpret_cast<const byte*>(text.begin()), text.size()));
+  }
 
-    lines.add(kj::str(method, " /", path, " HTTP/1.1"));
-    lines.add(kj::str("Connection: close"));
-    if (extraHeader1 != nullptr) {
-      lines.add(kj::mv(extraHeader1));
+  static void appendCookies(kj::Vector<byte>& out, WebSession::Context::Reader context) {
+    auto cookies = context.getCookies();
+    if (cookies.size() == 0) return;
+
+    append(out, "Cookie: ");
+    bool first = true;
+    for (auto cookie: cookies) {
+      if (!first) append(out, "; ");
+      first = false;
+      append(out, cookie.getKey());
+      append(out, "=");
+      append(out, cookie.getValue());
     }
-    if (extraHeader2 != nullptr) {
-      lines.add(kj::mv(extraHeader2));
+    append(out, "\r\n");
+  }
+
+  kj::Array<byte> renderRequest(kj::StringPtr method, kj::StringPtr path,
+                                WebSession::Context::Reader requestContext,
+                                kj::Maybe<WebSession::PostContent::Reader> content) {
+    // Render the whole request -- headers and body -- into a single buffer.  Everything that is
+    // constant for the session came pre-rendered in fixedHeaders, so the hot path splices in
+    // only the request line, the content headers, and the cookies.
+
+    auto cookies = requestContext.getCookies();
+    size_t estimate = method.size() + path.size() + fixedHeaders.size() + 64;
+    for (auto cookie: cookies) {
+      estimate += cookie.getKey().size() + cookie.getValue().size() + 12;
+    }
+    KJ_IF_MAYBE(c, content) {
+      estimate += c->getMimeType().size() + c->getContent().size() + 64;
+    }
+
+    kj::Vector<byte> out(estimate);
+    append(out, method);
+    append(out, " /");
+    append(out, path);
+    append(out, " HTTP/1.1\r\n");
+    append(out, fixedHeaders);
+
+    KJ_IF_MAYBE(c, content) {
+      append(out, "Content-Type: ");
+      append(out, c->getMimeType());
+      char buffer[48];
+      int n = snprintf(buffer, sizeof(buffer), "\r\nContent-Length: %llu\r\n",
+                       (unsigned long long)c->getContent().size());
+      out.addAll(kj::ArrayPtr<const byte>(reinterpret_cast<const byte*>(buffer), n));
     }
-    lines.add(kj::str("Accept: */*"));
-    lines.add(kj::str("Accept-Encoding: gzip"));
-    lines.add(kj::str("Accept-Language: ", acceptLanguages));
 
-    addCommonHeaders(lines, context);
+    appendCookies(out, requestContext);
+    append(out, "\r\n");
 
-    return kj::strArray(lines, "\r\n");
+    KJ_IF_MAYBE(c, content) {
+      out.addAll(c->getContent());
+    }
+
+    return out.releaseAsArray();
   }
 
-  void addCommonHeaders(kj::Vector<kj::String>& lines, WebSession::Context::Reader context) {
-    lines.add(kj::str("Host: sandbox"));
-    lines.add(kj::str("User-Agent: ", userAgent));
-    lines.add(kj::str("X-Sandstorm-Username: ", userDisplayName));
-    lines.add(kj::str("X-Sandstorm-Base-Path: ", basePath));
+  kj::Array<byte> renderWebSocketRequest(kj::StringPtr path,
+                                         capnp::List<capnp::Text>::Reader protocols,
+                                         WebSession::Context::Reader requestContext) {
+    size_t estimate = path.size() + sessionHeaders.size() + 256;
+    for (auto protocol: protocols) {
+      estimate += protocol.size() + 2;
+    }
 
-    auto cookies = context.getCookies();
-    if (cookies.size() > 0) {
-      lines.add(kj::str("Cookie: ", kj::strArray(
-            KJ_MAP(c, cookies) {
-              return kj::str(c.getKey(), "=", c.getValue());
-            }, "; ")));
+    kj::Vector<byte> out(estimate);
+    append(out, "GET /");
+    append(out, path);
+    append(out, " HTTP/1.1\r\n"
+                "Upgrade: websocket\r\n"
+                "Connection: Upgrade\r\n"
+                "Sec-WebSocket-Key: mj9i153gxeYNlGDoKdoXOQ==\r\n");
+    if (protocols.size() > 0) {
+      append(out, "Sec-WebSocket-Protocol: ");
+      bool first = true;
+      for (auto protocol: protocols) {
+        if (!first) append(out, ", ");
+        first = false;
+        append(out, protocol);
+      }
+      append(out, "\r\n");
     }
+    append(out, "Sec-WebSocket-Version: 13\r\n");
+    append(out, sessionHeaders);
+    appendCookies(out, requestContext);
+    append(out, "\r\n");
 
-    lines.add(kj::str(""));
-    lines.add(kj::str(""));
+    return out.releaseAsArray();
   }
 
-  kj::Array<byte> toBytes(kj::StringPtr text, kj::ArrayPtr<const byte> data = nullptr) {
-    auto result = kj::heapArray<byte>(text.size() + data.size());
-    memcpy(result.begin(), text.begin(), text.size());
-    memcpy(result.begin() + text.size(), data.begin(), data.size());
-    return result;
+  static kj::Maybe<ByteStream::Client> getResponseStream(WebSession::Context::Reader context) {
+    if (context.hasResponseStream()) {
+      return context.getResponseStream();
+    } else {
+      return nullptr;
+    }
   }
 
   template <typename Context>
-  kj::Promise<void> sendRequest(kj::Array<byte> httpRequest, Context& context) {
+  kj::Promise<void> sendRequest(kj::Array<byte> httpRequest,
+                                kj::Maybe<ByteStream::Client> responseStream, Context& context) {
     context.releaseParams();
-    return serverAddr.connect().then(
-        [KJ_MVCAP(httpRequest)](kj::Own<kj::AsyncIoStream>&& stream) mutable {
-      kj::ArrayPtr<const byte> httpRequestRef = httpRequest;
-      auto& streamRef = *stream;
-      return streamRef.write(httpRequestRef.begin(), httpRequestRef.size())
-          .attach(kj::mv(httpRequest))
-          .then([KJ_MVCAP(stream)]() mutable {
-        // Note:  Do not do stream->shutdownWrite() as some HTTP servers will decide to close the
-        // socket immediately on EOF, even if they have not actually responded to previous requests
-        // yet.
-        return readAll(kj::mv(stream));
-      });
-    }).then([context](kj::Vector<char>&& buffer) mutable {
-      KJ_ASSERT(buffer.size() > 0, "Sandboxed server returned no data.");
-      HttpParser parser;
-      parser.parse(buffer);
-      parser.build(context.getResults());
-    });
+
+    KJ_IF_MAYBE(w, worker) {
+      if (responseStream == nullptr) {
+        // Hand the request off to this session's worker thread, then copy the response message
+        // it built into the RPC results.
+        return w->sendRequest(kj::mv(httpRequest))
+            .then([context](kj::Own<capnp::MallocMessageBuilder>&& response) mutable {
+          context.setResults(response->getRoot<WebSession::Response>().asReader());
+        });
+      }
+      // Requests with a response stream interact with a caller-provided capability, which
+      // belongs to this thread's RPC system, so fall through to the local path.
+    }
+
+    kj::ArrayPtr<const byte> httpRequestRef = httpRequest;
+    return performHttpRequest(pool, metrics, httpRequestRef, kj::mv(responseStream),
+                              context.getResults())
+        .attach(kj::mv(httpRequest));
   }
 };
 
 class UiViewImpl final: public UiView::Server {
 public:
-  explicit UiViewImpl(kj::NetworkAddress& serverAddress): serverAddress(serverAddress) {}
+  UiViewImpl(kj::NetworkAddress& serverAddress, BridgeMetrics& metrics,
+             kj::Maybe<WorkerPool&> workerPool)
+      : connectionPool(serverAddress), metrics(metrics), workerPool(workerPool) {}
 
 //  kj::Promise<void> getViewInfo(GetViewInfoContext context) override;
 
@@ -798,15 +1960,28 @@ public:
     KJ_REQUIRE(params.getSessionType() == capnp::typeId<WebSession>(),
                "Unsupported session type.");
 
+    kj::Maybe<WorkerPool::Worker&> worker;
+    KJ_IF_MAYBE(pool, workerPool) {
+      worker = pool->next();
+    }
+
     context.getResults(capnp::MessageSize {2, 1}).setSession(
-        kj::heap<WebSessionImpl>(serverAddress, params.getUserInfo(), params.getContext(),
+        kj::heap<WebSessionImpl>(connectionPool, metrics, worker, params.getUserInfo(),
+                                 params.getContext(),
                                  params.getSessionParams().getAs<WebSession::Params>()));
 
     return kj::READY_NOW;
   }
 
 private:
-  kj::NetworkAddress& serverAddress;
+  ConnectionPool connectionPool;
+  // Shared across all sessions handled on the main thread, since they all talk to the same app
+  // server.  (Workers have their own pools.)
+
+  BridgeMetrics& metrics;
+  // The main thread's metrics block.  (Workers have their own.)
+
+  kj::Maybe<WorkerPool&> workerPool;
 };
 
 class LegacyBridgeMain {
@@ -824,6 +1999,10 @@ public:
                            "Acts as a Sandstorm init application.  Runs <command>, then tries to "
                            "connect to it as an HTTP server at the given address (typically, "
                            "'127.0.0.1:<port>') in order to handle incoming requests.")
+        .addOptionWithArg({'t', "threads"}, KJ_BIND_METHOD(*this, setThreadCount), "<count>",
+                          "Shard request handling across <count> worker threads, so that a "
+                          "busy grain isn't limited to one core.  Sessions are distributed "
+                          "across the workers round-robin.")
         .expectArg("<address>", KJ_BIND_METHOD(*this, setAddress))
         .expectOneOrMoreArgs("<command>", KJ_BIND_METHOD(*this, addCommandArg))
         .callAfterParsing(KJ_BIND_METHOD(*this, run))
@@ -831,6 +2010,7 @@ public:
   }
 
   kj::MainBuilder::Validity setAddress(kj::StringPtr addr) {
+    addressStr = kj::heapString(addr);
     return ioContext.provider->getNetwork().parseAddress(addr)
         .then([this](kj::Own<kj::NetworkAddress>&& parsedAddr) -> kj::MainBuilder::Validity {
       this->address = kj::mv(parsedAddr);
@@ -840,6 +2020,15 @@ public:
     }).wait(ioContext.waitScope);
   }
 
+  kj::MainBuilder::Validity setThreadCount(kj::StringPtr count) {
+    char* end;
+    threadCount = strtoul(count.cStr(), &end, 10);
+    if (count.size() == 0 || *end != '\0') {
+      return "Invalid thread count.";
+    }
+    return true;
+  }
+
   kj::MainBuilder::Validity addCommandArg(kj::StringPtr arg) {
     command.add(kj::heapString(arg));
     return true;
@@ -847,8 +2036,8 @@ public:
 
   class Restorer: public capnp::SturdyRefRestorer<capnp::AnyPointer> {
   public:
-    explicit Restorer(capnp::Capability::Client&& defaultCap)
-        : defaultCap(kj::mv(defaultCap)) {}
+    Restorer(capnp::Capability::Client&& defaultCap, capnp::Capability::Client&& statsCap)
+        : defaultCap(kj::mv(defaultCap)), statsCap(kj::mv(statsCap)) {}
 
     capnp::Capability::Client restore(capnp::AnyPointer::Reader ref) override {
       // TODO(soon):  Make it possible to export a default capability on two-party connections.
@@ -859,12 +2048,18 @@ public:
         return defaultCap;
       }
 
+      if (ref.getAs<capnp::Text>() == "stats") {
+        // Instrumentation for the shell / ops tooling; see bridge-stats.capnp.
+        return statsCap;
+      }
+
       // TODO(someday):  Implement level 2 RPC?
       KJ_FAIL_ASSERT("SturdyRefs not implemented.");
     }
 
   private:
     capnp::Capability::Client defaultCap;
+    capnp::Capability::Client statsCap;
   };
 
   kj::MainBuilder::Validity run() {
@@ -900,9 +2095,21 @@ public:
         usleep(10000);
       }
 
+      MetricsRegistry metricsRegistry;
+      auto& mainMetrics = metricsRegistry.add();
+
+      // Start the worker pool, if requested.
+      kj::Own<WorkerPool> workerPool;
+      kj::Maybe<WorkerPool&> workerPoolRef;
+      if (threadCount > 0) {
+        workerPool = kj::heap<WorkerPool>(ioContext, addressStr, threadCount, metricsRegistry);
+        workerPoolRef = *workerPool;
+      }
+
       auto stream = ioContext.lowLevelProvider->wrapSocketFd(3);
       capnp::TwoPartyVatNetwork network(*stream, capnp::rpc::twoparty::Side::CLIENT);
-      Restorer restorer(kj::heap<UiViewImpl>(*address));
+      Restorer restorer(kj::heap<UiViewImpl>(*address, mainMetrics, workerPoolRef),
+                        kj::heap<BridgeStatsImpl>(metricsRegistry));
       auto rpcSystem = capnp::makeRpcServer(network, restorer);
 
       // Get the SandstormApi by restoring a null SturdyRef.
@@ -922,7 +2129,9 @@ private:
   kj::ProcessContext& context;
   kj::AsyncIoContext ioContext;
   kj::Own<kj::NetworkAddress> address;
+  kj::String addressStr;
   kj::Vector<kj::String> command;
+  uint threadCount = 0;
 };
 
 }  // namespace sandstorm
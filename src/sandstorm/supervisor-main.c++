@@ -40,6 +40,8 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <time.h>
+#include <algorithm>
 #include <limits.h>
 #include <sched.h>
 #include <dirent.h>
@@ -61,10 +63,14 @@ typedef unsigned int uint;
 // =======================================================================================
 // Termination handling:  Must kill child if parent terminates.
 //
-// We also terminate automatically if we don't receive any keep-alives in a 5-minute interval.
+// We also hibernate the app automatically if we don't receive any keep-alives in a 5-minute
+// interval:  the app child is SIGSTOPped (its pages can then be reclaimed under memory
+// pressure) while the supervisor and its mount namespace stay alive, so that re-opening the
+// grain costs a SIGCONT instead of a full sandbox rebuild.
 
 pid_t childPid = 0;
 bool keepAlive = true;
+bool hibernating = false;
 
 void logSafely(const char* text) {
   // Log a message in an async-signal-safe way.
@@ -98,6 +104,18 @@ void killChildAndExit(int status) {
   _exit(status);
 }
 
+void wakeApp() {
+  // Resume the app child if it was hibernated, and note that the grain is in use.  Called from
+  // the event loop (never from a signal handler).
+
+  if (hibernating && childPid != 0) {
+    SANDSTORM_LOG("Resuming hibernated grain.");
+    KJ_SYSCALL(kill(childPid, SIGCONT)) { break; }
+    hibernating = false;
+  }
+  keepAlive = true;
+}
+
 void signalHandler(int signo) {
   switch (signo) {
     case SIGCHLD:
@@ -105,15 +123,6 @@ void signalHandler(int signo) {
       SANDSTORM_LOG("Grain shutting down because child exited.");
       _exit(0);
 
-    case SIGALRM:
-      if (keepAlive) {
-        SANDSTORM_LOG("Grain still in use; staying up for now.");
-        keepAlive = false;
-        return;
-      }
-      SANDSTORM_LOG("Grain no longer in use; shutting down.");
-      killChildAndExit(0);
-
     case SIGINT:
     case SIGTERM:
       SANDSTORM_LOG("Grain supervisor terminated by signal.");
@@ -140,25 +149,114 @@ void registerSignalHandlers() {
   action.sa_handler = &signalHandler;
   sigfillset(&action.sa_mask);
 
-  // SIGALRM will fire every five minutes and will kill us if no keepalive was received in that
-  // time.
-  KJ_SYSCALL(sigaction(SIGALRM, &action, nullptr));
-
-  // Other death signals simply kill us immediately.
+  // Death signals simply kill us immediately.
   for (int signo: kj::ArrayPtr<int>(DEATH_SIGNALS)) {
     KJ_SYSCALL(sigaction(signo, &action, nullptr));
   }
 
-  // SIGCHLD will fire when the child exits, in which case we might as well also exit.
+  // SIGCHLD will fire when the child exits, in which case we might as well also exit.  (The
+  // watchdog SIGSTOPs the child when hibernating; SA_NOCLDSTOP keeps that from looking like an
+  // exit.)
   action.sa_flags = SA_NOCLDSTOP;  // Only fire when child exits.
   KJ_SYSCALL(sigaction(SIGCHLD, &action, nullptr));
 
-  // Set up the SIGALRM timer.  Note that this is not inherited over fork.
-  struct itimerval timer;
-  memset(&timer, 0, sizeof(timer));
-  timer.it_interval.tv_sec = 300;
-  timer.it_value.tv_sec = 300;
-  KJ_SYSCALL(setitimer(ITIMER_REAL, &timer, nullptr));
+  // Note:  The idle watchdog that used to live here as a setitimer(ITIMER_REAL) killer is now an
+  // event-loop timer in runSupervisor(), which hibernates rather than kills; see watchdogLoop().
+}
+
+// =======================================================================================
+// Startup tracing.
+
+uint64_t nowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+constexpr uint SETUP_PHASE_COUNT = 6;
+const char* const SETUP_PHASE_NAMES[SETUP_PHASE_COUNT] = {
+  // The phases of setupSupervisor(), in order.
+  "credsAndFds", "checkPaths", "unshareOuter", "setupTmpfs", "bindDirs", "setupStdio"
+};
+
+// =======================================================================================
+// Resource accounting.
+//
+// The supervisor chroots itself, so /proc is out of reach by the time the grain is running; we
+// keep a directory fd on /proc from before the chroot and sample the app child through it on
+// demand.  The kernel maintains all of these numbers (including the RSS high-water mark)
+// itself, so sampling costs a few reads and no per-request work.
+
+struct ResourceSample {
+  uint64_t cpuUserNanos = 0;
+  uint64_t cpuSystemNanos = 0;
+  uint64_t rssBytes = 0;
+  uint64_t rssHighWaterBytes = 0;
+  uint64_t ioBytesRead = 0;
+  uint64_t ioBytesWritten = 0;
+};
+
+kj::Maybe<kj::String> tryReadProcFile(int procFd, kj::StringPtr path) {
+  int fd = openat(procFd, path.cStr(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    // E.g. the process already exited, or /proc/<pid>/io is restricted.
+    return nullptr;
+  }
+  kj::AutoCloseFd closer(fd);
+
+  char buffer[4096];
+  ssize_t n;
+  KJ_SYSCALL(n = read(fd, buffer, sizeof(buffer) - 1));
+  return kj::heapString(buffer, n);
+}
+
+uint64_t parseProcKeyValue(kj::StringPtr content, kj::StringPtr key) {
+  // Find "<key>" in a /proc key-value file and return the number following it.
+
+  const char* pos = strstr(content.cStr(), key.cStr());
+  if (pos == nullptr) return 0;
+  return strtoull(pos + key.size(), nullptr, 10);
+}
+
+ResourceSample sampleResources(int procFd, pid_t pid) {
+  ResourceSample result;
+
+  KJ_IF_MAYBE(stat, tryReadProcFile(procFd, kj::str(pid, "/stat"))) {
+    // utime and stime are fields 14 and 15.  The command name (field 2) can contain spaces and
+    // parentheses, so scan from the last ')'.
+    const char* pos = strrchr(stat->cStr(), ')');
+    if (pos != nullptr) {
+      // `pos` starts on the ')' ending field 2; each strchr() step lands it on the space
+      // preceding the next field, so stop once it precedes field 14 (utime).
+      uint field = 2;
+      while (pos != nullptr && field < 14) {
+        pos = strchr(pos + 1, ' ');
+        ++field;
+      }
+      if (pos != nullptr) {
+        char* end;
+        uint64_t utime = strtoull(pos, &end, 10);
+        uint64_t stime = strtoull(end, nullptr, 10);
+        long hz = sysconf(_SC_CLK_TCK);
+        if (hz > 0) {
+          result.cpuUserNanos = utime * (1000000000ull / hz);
+          result.cpuSystemNanos = stime * (1000000000ull / hz);
+        }
+      }
+    }
+  }
+
+  KJ_IF_MAYBE(status, tryReadProcFile(procFd, kj::str(pid, "/status"))) {
+    result.rssBytes = parseProcKeyValue(*status, "VmRSS:") * 1024;
+    result.rssHighWaterBytes = parseProcKeyValue(*status, "VmHWM:") * 1024;
+  }
+
+  KJ_IF_MAYBE(io, tryReadProcFile(procFd, kj::str(pid, "/io"))) {
+    result.ioBytesRead = parseProcKeyValue(*io, "read_bytes:");
+    result.ioBytesWritten = parseProcKeyValue(*io, "write_bytes:");
+  }
+
+  return result;
 }
 
 // =======================================================================================
@@ -186,7 +284,15 @@ class SupervisorMain {
   // discussed in Sandstorm and Cap'n Proto.)
 
 public:
-  SupervisorMain(kj::ProcessContext& context): context(context) {
+  struct PrewarmInfo {
+    // Passed to supervisor instances running inside a zygote template, whose sandbox prefix
+    // (namespaces, tmpfs skeleton) was already set up before the grain was known.
+    uid_t uid;
+    gid_t gid;
+  };
+
+  SupervisorMain(kj::ProcessContext& context, kj::Maybe<PrewarmInfo> prewarm = nullptr)
+      : context(context), prewarm(prewarm) {
     // Make sure we didn't inherit a weird signal mask from the parent process.  Gotta do this as
     // early as possible so as not to confuse KJ code that deals with signals.
     sigset_t sigset;
@@ -225,9 +331,31 @@ public:
                    "Don't redirect the sandbox's stdio.  Useful for debugging.")
         .addOption({'n', "new"}, [this]() { setIsNew(true); return true; },
                    "Initializes a new grain.  (Otherwise, runs an existing one.)")
-        .expectArg("<app-name>", KJ_BIND_METHOD(*this, setAppName))
-        .expectArg("<grain-id>", KJ_BIND_METHOD(*this, setGrainId))
-        .expectOneOrMoreArgs("<command>", KJ_BIND_METHOD(*this, addCommandArg))
+        .addOption({"overlay"}, [this]() { useOverlay = true; return true; },
+                   "Give the grain a writable root filesystem backed by overlayfs:  the app "
+                   "package is the read-only lower layer, whose page cache is shared by every "
+                   "grain of the app, and writes go to a per-grain upper directory inside the "
+                   "grain's var.  Requires kernel overlayfs support.")
+        .addOptionWithArg({"zygote"}, KJ_BIND_METHOD(*this, setZygotePath), "<socket>",
+                          "Run as a zygote daemon instead of starting a grain:  pre-fork sandbox "
+                          "template processes with their namespaces and filesystem skeleton "
+                          "already set up, and specialize one per grain-start request received "
+                          "on <socket>.  Requires --uid/--gid when root.  <app-name> etc. are "
+                          "not used in this mode.")
+        .addOption({"trace-startup"}, [this]() { traceStartup = true; return true; },
+                   "Record monotonic timestamps around each sandbox setup phase and report the "
+                   "timings to stderr once setup completes.")
+        .addOptionWithArg({"bench-setup"}, KJ_BIND_METHOD(*this, setBenchCycles), "<cycles>",
+                          "Instead of starting the grain, run <cycles> sandbox setup/teardown "
+                          "cycles (one forked child per cycle; the namespaces die with it) and "
+                          "report per-phase timing distributions.  Needs the same privileges as "
+                          "a real grain start.  See 'make bench-supervisor'.")
+        .addOptionWithArg({"use-zygote"}, KJ_BIND_METHOD(*this, setUseZygotePath), "<socket>",
+                          "Start the grain via the zygote daemon listening on <socket> rather "
+                          "than setting up a sandbox from scratch in this process.")
+        .expectOptionalArg("<app-name>", KJ_BIND_METHOD(*this, setAppName))
+        .expectOptionalArg("<grain-id>", KJ_BIND_METHOD(*this, setGrainId))
+        .expectZeroOrMoreArgs("<command>", KJ_BIND_METHOD(*this, addCommandArg))
         .callAfterParsing(KJ_BIND_METHOD(*this, run))
         .build();
   }
@@ -332,8 +460,44 @@ public:
 
   // =====================================================================================
 
+  kj::MainBuilder::Validity setZygotePath(kj::StringPtr path) {
+    zygotePath = kj::heapString(path);
+    return true;
+  }
+
+  kj::MainBuilder::Validity setUseZygotePath(kj::StringPtr path) {
+    useZygotePath = kj::heapString(path);
+    return true;
+  }
+
+  kj::MainBuilder::Validity setBenchCycles(kj::StringPtr arg) {
+    char* end;
+    benchCycles = strtoul(arg.cStr(), &end, 10);
+    if (arg.size() == 0 || *end != '\0' || benchCycles == 0) {
+      return "Expected a positive number of cycles.";
+    }
+    return true;
+  }
+
   kj::MainBuilder::Validity run() {
+    if (zygotePath != nullptr) {
+      return runZygote();
+    }
+
+    if (appName == nullptr || grainId == nullptr || command.size() == 0) {
+      return "Must specify an app name, grain id, and command.";
+    }
+
+    if (useZygotePath != nullptr) {
+      return runViaZygote();
+    }
+
+    if (benchCycles > 0) {
+      return runSetupBench();
+    }
+
     setupSupervisor();
+    emitStartupTrace();
 
     checkIfAlreadyRunning();  // Exits if another supervisor is still running in this sandbox.
 
@@ -345,6 +509,29 @@ public:
     int fds[2];
     KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
 
+    // Give the socket deep buffers:  WebSession responses carrying file downloads regularly run
+    // to megabytes, and the default unix socket buffer forces a sender wakeup every couple
+    // hundred kilobytes.  With a megabyte in flight each way, a large message crosses the
+    // sandbox boundary in a handful of syscalls.
+    //
+    // TODO(perf):  The copies themselves could be eliminated with a shared-memory transport --
+    //   a ring of message segments in a memfd mapped by both processes, with the socket retained
+    //   only for signaling and fd passing -- but Cap'n Proto's two-party transport currently
+    //   offers no seam to plug that in; it consumes an AsyncIoStream directly.  Revisit when the
+    //   RPC layer grows a pluggable message transport.
+    // Note the *FORCE variants:  the plain options are silently clamped to the (small)
+    // net.core.*mem_max limits, while we still have the privilege to exceed them.  Fall back to
+    // the clamped versions when running as a plain user.
+    int bufferSize = 1 << 20;
+    for (int fd: fds) {
+      if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &bufferSize, sizeof(bufferSize)) < 0) {
+        KJ_SYSCALL(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize)));
+      }
+      if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bufferSize, sizeof(bufferSize)) < 0) {
+        KJ_SYSCALL(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize)));
+      }
+    }
+
     // Now time to run the start command, in a further chroot.
     KJ_SYSCALL(childPid = fork());
     if (childPid == 0) {
@@ -362,6 +549,13 @@ public:
 private:
   kj::ProcessContext& context;
 
+  kj::Maybe<PrewarmInfo> prewarm;
+  // Non-null if this instance runs inside a zygote template whose sandbox prefix is already set
+  // up; see runZygote().
+
+  kj::String zygotePath;
+  kj::String useZygotePath;
+
   kj::String appName;
   kj::String grainId;
   kj::String pkgPath;
@@ -371,6 +565,21 @@ private:
   bool isNew = false;
   bool mountProc = false;
   bool keepStdio = false;
+  bool useOverlay = false;
+  bool traceStartup = false;
+  uint benchCycles = 0;
+
+  uint64_t phaseNanos[SETUP_PHASE_COUNT] = {0};
+  uint phaseCount = 0;
+  uint64_t phaseStart = 0;
+  // Startup-phase timings; see beginTrace()/tracePhase().
+
+  int benchReportFd = -1;
+  // In a bench-cycle child:  the pipe on which the timings are reported.  closeFds() must spare
+  // it.
+
+  kj::AutoCloseFd procFd;
+  // Directory fd on the real /proc, captured before we chroot, for resource sampling.
   uid_t uid = 0;
   gid_t gid = 0;
   gid_t gidFromUsername = 0;  // If --uid was given a username.
@@ -398,23 +607,161 @@ private:
   // =====================================================================================
 
   void setupSupervisor() {
-    // Enable no_new_privs so that once we drop privileges we can never regain them through e.g.
-    // execing a suid-root binary.  Sandboxed apps should not need that.
-    KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
+    KJ_IF_MAYBE(p, prewarm) {
+      // We're a zygote template:  the grain-independent prefix below already ran before this
+      // grain was known.  Just verify credentials and do the grain-specific part.
+      if (uid == 0) uid = p->uid;
+      if (gid == 0) gid = p->gid;
+      KJ_REQUIRE(uid == p->uid && gid == p->gid,
+                 "Requested uid/gid don't match what the zygote was started with.");
+
+      checkPaths();
+      bindDirs();
+      setupStdio();
+      return;
+    }
 
-    validateCreds();
-    closeFds();
+    beginTrace();
+    prewarmSetup();
+    tracePhase();
     checkPaths();
+    tracePhase();
     unshareOuter();
+    tracePhase();
     setupTmpfs();
+    tracePhase();
     bindDirs();
+    tracePhase();
     setupStdio();
+    tracePhase();
 
     // TODO(someday):  Turn on seccomp-bpf.
 
     // Note:  permanentlyDropSuperuser() is performed post-fork; see comment in function def.
   }
 
+  bool tracingStartup() {
+    return traceStartup || benchCycles > 0;
+  }
+
+  void beginTrace() {
+    if (!tracingStartup()) return;
+    phaseCount = 0;
+    phaseStart = nowNanos();
+  }
+
+  void tracePhase() {
+    if (!tracingStartup() || phaseCount >= SETUP_PHASE_COUNT) return;
+    uint64_t now = nowNanos();
+    phaseNanos[phaseCount++] = now - phaseStart;
+    phaseStart = now;
+  }
+
+  void emitStartupTrace() {
+    if (!traceStartup || phaseCount == 0) return;
+
+    kj::Vector<kj::String> parts(phaseCount);
+    for (uint i = 0; i < phaseCount; i++) {
+      parts.add(kj::str(" ", SETUP_PHASE_NAMES[i], "=", phaseNanos[i] / 1000, "us"));
+    }
+    auto msg = kj::str("** SANDSTORM SUPERVISOR: startup trace:",
+                       kj::strArray(parts, ""), "\n");
+    // Note that if stdio was redirected, this lands in the grain's log, which is where we'd
+    // want it anyway.
+    KJ_SYSCALL(write(STDERR_FILENO, msg.begin(), msg.size())) { return; }
+  }
+
+  kj::MainBuilder::Validity runSetupBench() {
+    // Run sandbox setup over and over, forking a child for each cycle:  the child performs the
+    // full setup, reports its per-phase timings over a pipe, and exits, at which point its
+    // namespaces -- mounts, tmpfs, and all -- evaporate, which is the teardown half of the
+    // cycle.
+
+    // The cycles act like starts of an existing grain, so make sure the var directory exists.
+    if (pkgPath == nullptr) pkgPath = kj::str("/var/sandstorm/apps/", appName);
+    if (varPath == nullptr) varPath = kj::str("/var/sandstorm/grains/", grainId);
+    isNew = false;
+    auto sandboxVar = kj::str(varPath, "/sandbox");
+    const char* benchDirs[] = { varPath.cStr(), sandboxVar.cStr() };
+    for (const char* dir: benchDirs) {
+      if (mkdir(dir, 0770) < 0) {
+        int error = errno;
+        if (error != EEXIST) {
+          KJ_FAIL_SYSCALL("mkdir", error, dir);
+        }
+      }
+    }
+
+    kj::Vector<uint64_t> samples[SETUP_PHASE_COUNT];
+    for (uint i = 0; i < SETUP_PHASE_COUNT; i++) {
+      samples[i] = kj::Vector<uint64_t>(benchCycles);
+    }
+
+    for (uint cycle = 0; cycle < benchCycles; cycle++) {
+      int fds[2];
+      KJ_SYSCALL(pipe(fds));
+
+      pid_t pid;
+      KJ_SYSCALL(pid = fork());
+      if (pid == 0) {
+        close(fds[0]);
+        benchReportFd = fds[1];
+        if (kj::runCatchingExceptions([&]() { setupSupervisor(); }) != nullptr) {
+          _exit(1);
+        }
+        KJ_SYSCALL(write(fds[1], phaseNanos, sizeof(phaseNanos))) { _exit(1); }
+        _exit(0);
+      }
+
+      close(fds[1]);
+      uint64_t nanos[SETUP_PHASE_COUNT];
+      ssize_t n = read(fds[0], nanos, sizeof(nanos));
+      close(fds[0]);
+
+      int status;
+      KJ_SYSCALL(waitpid(pid, &status, 0));
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || n != sizeof(nanos)) {
+        return "Sandbox setup failed.  (Benchmarking needs the same privileges as starting a "
+               "real grain -- run as root or via the suid binary.)";
+      }
+
+      for (uint i = 0; i < SETUP_PHASE_COUNT; i++) {
+        samples[i].add(nanos[i]);
+      }
+    }
+
+    kj::Vector<kj::String> lines(SETUP_PHASE_COUNT + 1);
+    uint64_t totalMedian = 0;
+    for (uint i = 0; i < SETUP_PHASE_COUNT; i++) {
+      std::sort(samples[i].begin(), samples[i].end());
+      auto percentile = [&](double p) {
+        return samples[i][(size_t)(p * (samples[i].size() - 1))] / 1000;
+      };
+      totalMedian += percentile(0.5);
+      lines.add(kj::str(SETUP_PHASE_NAMES[i], ": p50=", percentile(0.5),
+                        "us p90=", percentile(0.9), "us p99=", percentile(0.99),
+                        "us max=", percentile(1.0), "us\n"));
+    }
+    lines.add(kj::str("total (sum of p50s): ", totalMedian, "us over ",
+                      benchCycles, " cycles\n"));
+
+    auto report = kj::strArray(lines, "");
+    KJ_SYSCALL(write(STDOUT_FILENO, report.begin(), report.size()));
+    return true;
+  }
+
+  void prewarmSetup() {
+    // The grain-independent part of sandbox setup.  In normal operation this runs at grain start;
+    // a zygote runs it in each template process ahead of time, before any grain is assigned.
+
+    // Enable no_new_privs so that once we drop privileges we can never regain them through e.g.
+    // execing a suid-root binary.  Sandboxed apps should not need that.
+    KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
+
+    validateCreds();
+    closeFds(benchReportFd);
+  }
+
   void validateCreds() {
     if (gid == 0) {
       // --gid was not given.  If --uid specified a user name, use that user's default GID.
@@ -435,11 +782,13 @@ private:
     }
   }
 
-  void closeFds() {
+  void closeFds(int exceptFd = -1) {
     // Close all unexpected file descriptors (i.e. other than stdin/stdout/stderr).  This is a
     // safety measure incase we were launched by a badly-written parent program which forgot to
     // set CLOEXEC on its private file descriptors.  We don't want the sandboxed process to
     // accidentally get access to those.
+    //
+    // `exceptFd`, if given, is spared; the zygote template needs to keep its control socket.
 
     // We detect open file descriptors by reading from /proc.
     //
@@ -472,7 +821,7 @@ private:
           int fd = strtoul(eptr->d_name, &end, 10);
           KJ_ASSERT(*end == '\0' && end > eptr->d_name,
                     "File in /proc/self/fd had non-numeric name?", eptr->d_name);
-          if (fd > STDERR_FILENO) {
+          if (fd > STDERR_FILENO && fd != exceptFd) {
             fds.add(fd);
           }
         }
@@ -542,6 +891,24 @@ private:
         O_WRONLY | O_APPEND | O_CLOEXEC | O_CREAT, 0600));
     KJ_SYSCALL(close(logfd));
 
+    // Create the overlay upper and work directories, if --overlay was given.  They live in the
+    // grain's var, so the layer of written files is part of the grain's persistent data.
+    if (useOverlay) {
+      for (auto dir: { "/overlay", "/overlay.work" }) {
+        if (mkdir(kj::str(varPath, dir).cStr(), 0770) < 0) {
+          int error = errno;
+          if (error != EEXIST) {
+            KJ_FAIL_SYSCALL("mkdir(<var>/overlay*)", error, varPath, dir);
+          }
+        }
+      }
+    }
+
+    // Keep a handle on /proc so we can sample the app's resource usage after chrooting.
+    int pfd;
+    KJ_SYSCALL(pfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    procFd = kj::AutoCloseFd(pfd);
+
     // Restore superuser access (e.g. so that we can do mknod later).
     KJ_SYSCALL(seteuid(olduid));
     KJ_SYSCALL(setegid(oldgid));
@@ -599,8 +966,21 @@ private:
   }
 
   void bindDirs() {
-    // Bind the app package to "sandbox", which will be the grain's root directory.
-    bind(pkgPath, "sandbox", MS_NODEV | MS_RDONLY);
+    if (useOverlay) {
+      // Overlay a per-grain writable upper layer over the read-only app package, which becomes
+      // the grain's root directory.  The lower layer is the package itself, so all grains of
+      // the same app share its page cache, and this single mount replaces the read-only bind.
+      KJ_REQUIRE(pkgPath.findFirst(',') == nullptr && varPath.findFirst(',') == nullptr,
+                 "overlayfs mount options cannot represent paths containing commas.",
+                 pkgPath, varPath);
+      auto options = kj::str("lowerdir=", pkgPath, ",upperdir=", varPath, "/overlay",
+                             ",workdir=", varPath, "/overlay.work");
+      KJ_SYSCALL(mount("overlay", "sandbox", "overlay",
+                       MS_NOSUID | MS_NODEV | MS_NOATIME, options.cStr()), options);
+    } else {
+      // Bind the app package to "sandbox", which will be the grain's root directory.
+      bind(pkgPath, "sandbox", MS_NODEV | MS_RDONLY);
+    }
 
     // We want to chroot the supervisor.  It will need access to the var directory, so we need to
     // bind-mount that into the local tree.  We can't just map it to sandbox/var because part of
@@ -728,6 +1108,313 @@ private:
     permanentlyDropSuperuser();
   }
 
+  // =====================================================================================
+  // Zygote mode
+  //
+  // A zygote is a long-lived daemon that keeps a pool of pre-forked "template" processes, each
+  // with the grain-independent half of sandbox setup (namespaces unshared, tmpfs skeleton and
+  // device nodes mounted, Cap'n Proto runtime warm from this binary's static initialization)
+  // already done.  A grain start then only pays for the grain-specific work:  path checks, a
+  // few bind mounts, chroot, and exec of the app.  The shell talks to the zygote through
+  // `sandstorm-supervisor --use-zygote=<socket> <usual args...>`, which forwards the request
+  // and relays the "Listening..." handshake.
+
+  static bool sendFdTo(int socket, int fd) {
+    // Pass `fd` over the unix socket along with one data byte.  Returns false if the peer is
+    // gone (MSG_NOSIGNAL turns the SIGPIPE that would otherwise kill us into an error return),
+    // so the caller can pick another template.
+
+    char dataByte = 0;
+    struct iovec iov;
+    memset(&iov, 0, sizeof(iov));
+    iov.iov_base = &dataByte;
+    iov.iov_len = 1;
+
+    union {
+      struct cmsghdr alignment;
+      char buffer[CMSG_SPACE(sizeof(int))];
+    } cmsgStorage;
+    memset(&cmsgStorage, 0, sizeof(cmsgStorage));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgStorage.buffer;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int));
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    ssize_t n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    return n == 1;
+  }
+
+  static kj::AutoCloseFd receiveFdFrom(int socket) {
+    char dataByte = 0;
+    struct iovec iov;
+    memset(&iov, 0, sizeof(iov));
+    iov.iov_base = &dataByte;
+    iov.iov_len = 1;
+
+    union {
+      struct cmsghdr alignment;
+      char buffer[CMSG_SPACE(sizeof(int))];
+    } cmsgStorage;
+    memset(&cmsgStorage, 0, sizeof(cmsgStorage));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgStorage.buffer;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int));
+
+    ssize_t n;
+    KJ_SYSCALL(n = recvmsg(socket, &msg, 0));
+    KJ_REQUIRE(n == 1, "Zygote control socket closed unexpectedly.");
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    KJ_REQUIRE(cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+               cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(sizeof(int)),
+               "Expected a file descriptor on the zygote control socket.");
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return kj::AutoCloseFd(fd);
+  }
+
+  static constexpr uint ZYGOTE_POOL_SIZE = 4;
+  // Number of warm templates kept ready.  A burst larger than this falls back to waiting for
+  // replacement templates to warm up, which is still much cheaper than full cold starts arriving
+  // serially at the shell.
+
+  kj::MainBuilder::Validity runZygote() KJ_NORETURN {
+    // Credentials are validated once, up front; every template inherits them.
+    KJ_SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0));
+    validateCreds();
+
+    // Listen on the control socket.
+    int listenFd;
+    KJ_SYSCALL(listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    KJ_REQUIRE(zygotePath.size() < sizeof(addr.sun_path), "Zygote socket path too long.");
+    strcpy(addr.sun_path, zygotePath.cStr());
+    unlink(zygotePath.cStr());  // Clear stale socket, if any.
+    KJ_SYSCALL(bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)));
+    KJ_SYSCALL(listen(listenFd, 16));
+
+    struct Template {
+      pid_t pid;
+      kj::AutoCloseFd control;
+    };
+    kj::Vector<Template> templates;
+
+    auto spawnTemplate = [&]() {
+      int fds[2];
+      KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+      kj::AutoCloseFd controlParent(fds[0]), controlChild(fds[1]);
+
+      pid_t pid;
+      KJ_SYSCALL(pid = fork());
+      if (pid == 0) {
+        controlParent = nullptr;
+        runTemplate(controlChild);
+        KJ_UNREACHABLE;
+      }
+
+      templates.add(Template { pid, kj::mv(controlParent) });
+    };
+
+    for (uint i = 0; i < ZYGOTE_POOL_SIZE; i++) {
+      spawnTemplate();
+    }
+
+    SANDSTORM_LOG("Zygote ready.");
+
+    for (;;) {
+      int connFd;
+      KJ_SYSCALL(connFd = accept(listenFd, nullptr, nullptr));
+      kj::AutoCloseFd connection(connFd);
+
+      // Reap any templates that died (e.g. grains that already shut down started life as
+      // templates too, but those were removed from the pool; deaths here are warmup failures).
+      for (;;) {
+        int status;
+        pid_t dead = waitpid(-1, &status, WNOHANG);
+        if (dead <= 0) break;
+        for (size_t i = 0; i < templates.size(); i++) {
+          if (templates[i].pid == dead) {
+            if (i != templates.size() - 1) {
+              templates[i] = kj::mv(templates[templates.size() - 1]);
+            }
+            templates.resize(templates.size() - 1);
+            break;
+          }
+        }
+      }
+      while (templates.size() < ZYGOTE_POOL_SIZE) {
+        spawnTemplate();
+      }
+
+      // Hand the connection to the oldest template and drop it from the pool; it becomes the
+      // grain's supervisor process.  A template may have died since we last reaped (e.g. a
+      // warmup failure); if the handoff fails, discard it and try another rather than letting
+      // one bad template take the daemon down.
+      for (;;) {
+        if (templates.size() == 0) {
+          spawnTemplate();
+        }
+
+        auto chosen = kj::mv(templates[0]);
+        if (templates.size() > 1) {
+          templates[0] = kj::mv(templates[templates.size() - 1]);
+        }
+        templates.resize(templates.size() - 1);
+
+        if (sendFdTo(chosen.control, connection)) {
+          spawnTemplate();  // Replace it.
+          break;
+        }
+
+        SANDSTORM_LOG("Zygote template died before it could be used; discarding it.");
+      }
+    }
+  }
+
+  void runTemplate(int controlFd) KJ_NORETURN {
+    // One pre-warmed sandbox template.  Does everything that doesn't depend on which grain we
+    // will run, then blocks until the zygote hands us a grain-start connection.
+
+    PrewarmInfo info = { uid, gid };
+
+    closeFds(controlFd);
+    unshareOuter();
+
+    // In the normal flow checkPaths() creates the tmpfs mount point before setup gets here, but
+    // in a template checkPaths() only runs at specialization time, so make sure the directory
+    // exists (a fresh boot starts with an empty /tmp).
+    if (mkdir("/tmp/sandstorm-grain", 0770) < 0) {
+      int error = errno;
+      if (error != EEXIST) {
+        KJ_FAIL_SYSCALL("mkdir(\"/tmp/sandstorm-grain\")", error);
+      }
+    }
+
+    setupTmpfs();
+
+    // Wait for our grain.
+    auto connection = receiveFdFrom(controlFd);
+    KJ_SYSCALL(close(controlFd));
+
+    // Read the argument list:  newline-separated, terminated by a blank line.
+    kj::Vector<char> buffer;
+    for (;;) {
+      char c;
+      ssize_t n;
+      KJ_SYSCALL(n = read(connection, &c, 1));
+      KJ_REQUIRE(n == 1, "Grain-start connection closed before request was complete.");
+      if (c == '\n' && buffer.size() > 0 && buffer[buffer.size() - 1] == '\n') {
+        break;
+      }
+      buffer.add(c);
+    }
+    buffer.resize(buffer.size() - 1);  // Drop the final newline.
+
+    kj::Vector<kj::String> args;
+    size_t start = 0;
+    for (size_t i = 0; i <= buffer.size(); i++) {
+      if (i == buffer.size() || buffer[i] == '\n') {
+        args.add(kj::heapString(buffer.asPtr().slice(start, i).begin(), i - start));
+        start = i + 1;
+      }
+    }
+
+    // The handshake output ("Listening...") goes back over the connection.
+    KJ_SYSCALL(dup2(connection, STDOUT_FILENO));
+    connection = nullptr;
+
+    // Run a fresh supervisor over the received arguments, skipping the parts of setup we
+    // already did.
+    auto argPtrs = kj::heapArray<kj::StringPtr>(args.size());
+    for (size_t i = 0; i < args.size(); i++) {
+      argPtrs[i] = args[i];
+    }
+
+    SupervisorMain grainMain(context, info);
+    auto mainFunc = grainMain.getMain();
+    mainFunc(kj::StringPtr("sandstorm-supervisor"), argPtrs);
+    context.exit();
+  }
+
+  kj::MainBuilder::Validity runViaZygote() KJ_NORETURN {
+    // Forward this grain start to the zygote daemon and relay its output.
+
+    int connFd;
+    KJ_SYSCALL(connFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    kj::AutoCloseFd connection(connFd);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    KJ_REQUIRE(useZygotePath.size() < sizeof(addr.sun_path), "Zygote socket path too long.");
+    strcpy(addr.sun_path, useZygotePath.cStr());
+    KJ_SYSCALL(connect(connFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)),
+               useZygotePath);
+
+    auto args = rebuildArgs();
+    kj::Vector<char> request;
+    for (auto& arg: args) {
+      KJ_REQUIRE(arg.findFirst('\n') == nullptr, "Can't pass arguments containing newlines "
+                 "through the zygote.", arg);
+      request.addAll(kj::ArrayPtr<const char>(arg.begin(), arg.size()));
+      request.add('\n');
+    }
+    request.add('\n');
+
+    kj::FdOutputStream(connection.get()).write(request.begin(), request.size());
+
+    // Relay the one-line handshake ("Listening...\n" or "Already running...\n"), then get out
+    // of the way; the template is the grain's long-lived supervisor process, not us.
+    for (;;) {
+      char buffer[256];
+      ssize_t n;
+      KJ_SYSCALL(n = read(connection, buffer, sizeof(buffer)));
+      if (n == 0) break;
+      kj::FdOutputStream(STDOUT_FILENO).write(buffer, n);
+      if (memchr(buffer, '\n', n) != nullptr) break;
+    }
+
+    context.exit();
+  }
+
+  kj::Vector<kj::String> rebuildArgs() {
+    // Reconstruct a command line equivalent to our parsed state, to forward to the zygote.
+
+    kj::Vector<kj::String> args;
+    if (pkgPath != nullptr) args.add(kj::str("--pkg=", pkgPath));
+    if (varPath != nullptr) args.add(kj::str("--var=", varPath));
+    if (uid != 0) args.add(kj::str("--uid=", uid));
+    if (gid != 0) args.add(kj::str("--gid=", gid));
+    for (auto& env: environment) {
+      args.add(kj::str("--env=", env));
+    }
+    if (useOverlay) args.add(kj::heapString("--overlay"));
+    if (mountProc) args.add(kj::heapString("--proc"));
+    if (keepStdio) args.add(kj::heapString("--stdio"));
+    if (isNew) args.add(kj::heapString("--new"));
+    args.add(kj::heapString(appName));
+    args.add(kj::heapString(grainId));
+    for (auto& arg: command) {
+      args.add(kj::heapString(arg));
+    }
+    return args;
+  }
+
   // =====================================================================================
 
   void checkIfAlreadyRunning() {
@@ -856,15 +1543,17 @@ private:
 
   class SupervisorImpl final: public Supervisor::Server {
   public:
-    inline SupervisorImpl(UiView::Client&& mainView): mainView(kj::mv(mainView)) {}
+    inline SupervisorImpl(UiView::Client&& mainView, int procFd)
+        : mainView(kj::mv(mainView)), procFd(procFd) {}
 
     kj::Promise<void> getMainView(GetMainViewContext context) {
+      wakeApp();
       context.getResults(capnp::MessageSize {4, 1}).setView(mainView);
       return kj::READY_NOW;
     }
 
     kj::Promise<void> keepAlive(KeepAliveContext context) {
-      sandstorm::keepAlive = true;
+      wakeApp();
       return kj::READY_NOW;
     }
 
@@ -872,8 +1561,21 @@ private:
       killChildAndExit(0);
     }
 
+    kj::Promise<void> getResourceUsage(GetResourceUsageContext context) {
+      auto sample = sampleResources(procFd, childPid);
+      auto usage = context.getResults().initUsage();
+      usage.setCpuUserNanos(sample.cpuUserNanos);
+      usage.setCpuSystemNanos(sample.cpuSystemNanos);
+      usage.setRssBytes(sample.rssBytes);
+      usage.setRssHighWaterBytes(sample.rssHighWaterBytes);
+      usage.setIoBytesRead(sample.ioBytesRead);
+      usage.setIoBytesWritten(sample.ioBytesWritten);
+      return kj::READY_NOW;
+    }
+
   private:
     UiView::Client mainView;
+    int procFd;
   };
 
   class Restorer: public capnp::SturdyRefRestorer<capnp::AnyPointer> {
@@ -926,6 +1628,32 @@ private:
     }
   };
 
+  kj::Promise<void> watchdogLoop(kj::Timer& timer) {
+    // Check every five minutes whether any keep-alives arrived.  If not, hibernate:  SIGSTOP the
+    // app child, keeping the supervisor, its namespaces, and its mounts alive, so that the next
+    // keepAlive() or getMainView() can resume it with a SIGCONT in milliseconds instead of a
+    // full sandbox rebuild.  A stopped app's pages are reclaimable under memory pressure.
+    //
+    // Note that clients holding a direct UiView capability don't touch the supervisor's RPC
+    // objects, but the shell keep-alives any grain it is actively using at least once a minute,
+    // and that is what wakes us.
+    //
+    // TODO(someday):  Proactively release the stopped app's memory (e.g. via cgroups) rather
+    //   than waiting for global memory pressure to do it.
+
+    return timer.afterDelay(300 * kj::SECONDS).then([this, &timer]() {
+      if (sandstorm::keepAlive) {
+        SANDSTORM_LOG("Grain still in use; staying up for now.");
+        sandstorm::keepAlive = false;
+      } else if (!hibernating && childPid != 0) {
+        SANDSTORM_LOG("Grain no longer in use; hibernating.");
+        KJ_SYSCALL(kill(childPid, SIGSTOP)) { break; }
+        hibernating = true;
+      }
+      return watchdogLoop(timer);
+    });
+  }
+
   void runSupervisor(int apiFd) KJ_NORETURN {
     permanentlyDropSuperuser();
 
@@ -951,7 +1679,7 @@ private:
     // TODO(someday):  If there are multiple front-ends, or the front-ends restart a lot, we'll
     //   want to wrap the UiView and cache session objects.  Perhaps we could do this by making
     //   them persistable, though it's unclear how that would work with SessionContext.
-    Restorer serverRestorer(kj::heap<SupervisorImpl>(kj::mv(app)));
+    Restorer serverRestorer(kj::heap<SupervisorImpl>(kj::mv(app), procFd.get()));
     ErrorHandlerImpl errorHandler;
     kj::TaskSet tasks(errorHandler);
     unlink("/var/socket");  // Clear stale socket, if any.
@@ -963,8 +1691,14 @@ private:
       return promise.attach(kj::mv(serverPort));
     });
 
-    // Wait for disconnect or accept loop failure, then exit.
-    acceptTask.exclusiveJoin(appNetwork.onDisconnect()).wait(ioContext.waitScope);
+    // Start the idle watchdog.
+    auto watchdogTask = watchdogLoop(ioContext.provider->getTimer());
+
+    // Wait for disconnect or accept loop failure, then exit.  (The watchdog never resolves; it
+    // rides along here so that it keeps running.)
+    acceptTask.exclusiveJoin(appNetwork.onDisconnect())
+        .exclusiveJoin(kj::mv(watchdogTask))
+        .wait(ioContext.waitScope);
 
     SANDSTORM_LOG("App disconnected API socket; shutting down grain.");
     killChildAndExit(1);
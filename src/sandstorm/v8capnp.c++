@@ -42,10 +42,14 @@
 #include <kj/vector.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <capnp/rpc-twoparty.h>
 #include <capnp/rpc.capnp.h>
 #include <capnp/serialize.h>
 #include <unordered_map>
+#include <deque>
 #include <inttypes.h>
 #include <set>
 #include <stdlib.h>
@@ -66,18 +70,44 @@ typedef unsigned int uint;
 #define UV_CALL(code, loop, ...) \
   KJ_ASSERT(code == 0, uv_strerror(uv_last_error(loop)), ##__VA_ARGS__)
 
+class UvIoStream;
+
 class UvEventPort: public kj::EventPort {
+  // Bridges the KJ event loop onto libuv.  Wakeups are batched:  however many KJ events become
+  // runnable during one libuv iteration, the queue is drained exactly once, by a single check
+  // handle that runs after each iteration's polling.  An idle handle, started on the first
+  // runnable event and stopped at drain time, keeps the loop from blocking while KJ work is
+  // pending.  (Everything here runs on the loop thread, so plain flags suffice where a
+  // cross-thread port would need atomics.)
+  //
+  // The wakeupsRequested/drains counters expose the coalescing ratio; see loopStats().
+
 public:
-  UvEventPort(uv_loop_t* loop): loop(loop), kjLoop(*this) {}
+  UvEventPort(uv_loop_t* loop): loop(loop), kjLoop(*this) {
+    UV_CALL(uv_check_init(loop, &check), loop);
+    check.data = this;
+    UV_CALL(uv_idle_init(loop, &idle), loop);
+    idle.data = this;
+
+    UV_CALL(uv_check_start(&check, &doRun), loop);
+
+    // The check handle alone must not keep the loop alive.
+    uv_unref(reinterpret_cast<uv_handle_t*>(&check));
+  }
+
   ~UvEventPort() {
-    if (scheduled) {
-      UV_CALL(uv_timer_stop(&timer), loop);
+    if (idleActive) {
+      UV_CALL(uv_idle_stop(&idle), loop);
     }
+    UV_CALL(uv_check_stop(&check), loop);
   }
 
   kj::EventLoop& getKjLoop() { return kjLoop; }
   uv_loop_t* getUvLoop() { return loop; }
 
+  uint64_t getWakeupsRequested() { return wakeupsRequested; }
+  uint64_t getDrains() { return drains; }
+
   void wait() override {
     // TODO(someday):  Detect if loop will never have an event.
     UV_CALL(uv_run(loop, UV_RUN_ONCE), loop);
@@ -90,52 +120,83 @@ public:
   void setRunnable(bool runnable) override {
     if (runnable != this->runnable) {
       this->runnable = runnable;
-      if (runnable && !scheduled) {
-        schedule();
+      if (runnable) {
+        ++wakeupsRequested;
+        ensureAwake();
       }
     }
   }
 
+  void scheduleFlush(UvIoStream* stream) {
+    // Ask for `stream`'s queued output to be flushed at the tail of this loop iteration, after
+    // the KJ event queue has been drained -- so everything the iteration wrote merges into as
+    // few syscalls as possible.  See drainFlushQueue().
+    flushQueue.add(stream);
+    ensureAwake();
+  }
+
+  void cancelFlush(UvIoStream* stream) {
+    // Called when a stream with a scheduled flush is destroyed.
+    for (auto& entry: flushQueue) {
+      if (entry == stream) entry = nullptr;
+    }
+  }
+
 private:
   uv_loop_t* loop;
-  uv_timer_t timer;
+  uv_check_t check;
+  uv_idle_t idle;
   kj::EventLoop kjLoop;
   bool runnable = false;
-  bool scheduled = false;
-
-  void schedule() {
-    UV_CALL(uv_timer_init(loop, &timer), loop);
-    timer.data = this;
-    UV_CALL(uv_timer_start(&timer, &doRun, 0, 0), loop);
-    scheduled = true;
+  bool idleActive = false;
+  uint64_t wakeupsRequested = 0;
+  uint64_t drains = 0;
+
+  kj::Vector<UvIoStream*> flushQueue;
+  // Streams with output queued during this loop iteration; see scheduleFlush().
+
+  void ensureAwake() {
+    // Keep the loop from blocking in poll until the next run() has happened.
+    if (!idleActive) {
+      idleActive = true;
+      UV_CALL(uv_idle_start(&idle, &doNothing), loop);
+    }
   }
 
-  void run() {
-    KJ_ASSERT(scheduled);
+  void drainFlushQueue();
+  // Defined below UvIoStream.
 
-    UV_CALL(uv_timer_stop(&timer), loop);
+  void run() {
+    if (idleActive) {
+      UV_CALL(uv_idle_stop(&idle), loop);
+      idleActive = false;
+    }
 
     if (runnable) {
+      ++drains;
+
+      // Drains the entire runnable queue, so N promise resolutions cost this one callback.
       kjLoop.run();
     }
 
-    scheduled = false;
+    // Flush the output that the drain above produced, all in one place.
+    drainFlushQueue();
 
     if (runnable) {
-      // Apparently either we never became non-runnable, or we did but then became runnable again.
-      // Since `scheduled` has been true the whole time, we won't have been rescheduled, so do that
-      // now.
-      schedule();
-    } else {
-      scheduled = false;
+      // Still runnable (e.g. an event yielded); come back around without blocking.
+      ensureAwake();
     }
   }
 
-  static void doRun(uv_timer_t* handle, int status) {
+  static void doRun(uv_check_t* handle, int status) {
     if (status == 0) {
       reinterpret_cast<UvEventPort*>(handle->data)->run();
     }
   }
+
+  static void doNothing(uv_idle_t* handle, int status) {
+    // The idle handle exists only to keep the loop from blocking; the work happens in doRun().
+  }
 };
 
 void setNonblocking(int fd) {
@@ -289,9 +350,20 @@ class UvIoStream: public OwnedFileDescriptor, public kj::AsyncIoStream {
   // TODO(cleanup):  Allow better code sharing between the two.
 
 public:
-  UvIoStream(uv_loop_t* loop, int fd, uint flags)
-      : OwnedFileDescriptor(loop, fd, flags) {}
-  virtual ~UvIoStream() noexcept(false) {}
+  UvIoStream(UvEventPort& port, int fd, uint flags)
+      : OwnedFileDescriptor(port.getUvLoop(), fd, flags), port(port) {}
+  virtual ~UvIoStream() noexcept(false) {
+    if (flushScheduled) {
+      port.cancelFlush(this);
+    }
+
+    // Outstanding write cancelers must not touch this stream once it's gone.
+    for (auto& segment: outQueue) {
+      KJ_IF_MAYBE(c, segment.canceler) {
+        (*c)->stream = nullptr;
+      }
+    }
+  }
 
   kj::Promise<size_t> read(void* buffer, size_t minBytes, size_t maxBytes) override {
     return tryReadInternal(buffer, minBytes, maxBytes, 0).then([=](size_t result) {
@@ -309,41 +381,257 @@ public:
   }
 
   kj::Promise<void> write(const void* buffer, size_t size) override {
-    ssize_t writeResult;
-    KJ_NONBLOCKING_SYSCALL(writeResult = ::write(fd, buffer, size)) {
-      return kj::READY_NOW;
+    auto piece = kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size);
+    return queueWrite(kj::arrayPtr(&piece, 1));
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    return queueWrite(pieces);
+  }
+
+  void shutdownWrite() override {
+    // There's no legitimate way to get an AsyncStreamFd that isn't a socket through the
+    // UnixAsyncIoProvider interface.
+    if (outQueue.empty()) {
+      KJ_SYSCALL(shutdown(fd, SHUT_WR));
+    } else {
+      // Corked bytes are still queued; shut down once they're out.
+      shutdownAfterFlush = true;
     }
+  }
 
-    // A negative result means EAGAIN, which we can treat the same as having written zero bytes.
-    size_t n = writeResult < 0 ? 0 : writeResult;
+  void flushFromPort() {
+    // Called by UvEventPort at the tail of a loop iteration; see queueWrite().
+    flushScheduled = false;
+    flushNow();
+  }
 
-    if (n == size) {
+private:
+  static constexpr size_t CORK_THRESHOLD = 65536;
+  // Backpressure bound:  once this many bytes are queued, write() returns a promise that only
+  // resolves as the backlog drains, so a fast producer can't buffer without bound.
+
+  static constexpr size_t COPY_THRESHOLD = 2048;
+  // Writes smaller than this are copied into the queue and reported complete immediately
+  // (subject to CORK_THRESHOLD), which is what lets a burst of small messages coalesce:  the
+  // caller sees each write finish and queues the next one within the same loop iteration.
+  // Larger writes are queued by reference -- no copy -- and their promises resolve only once
+  // the bytes are actually written, which the AsyncOutputStream contract requires the caller
+  // to wait for before freeing the buffer anyway.
+
+  static constexpr size_t MAX_WRITEV_SEGMENTS = 64;
+
+  UvEventPort& port;
+
+  struct WriteCanceler: public kj::Refcounted {
+    // Shared between a borrowed write's returned promise and its last queued segment.  If the
+    // caller drops the promise while the write is still queued, the promise-side reference
+    // disarms the write (the caller may free the buffer immediately after canceling, and a
+    // canceled write must perform no further access); if the write completes or the stream
+    // dies first, `stream` is nulled so the canceler becomes a no-op.
+
+    UvIoStream* stream;
+    uint64_t id;
+
+    WriteCanceler(UvIoStream* stream, uint64_t id): stream(stream), id(id) {}
+  };
+
+  struct OutSegment {
+    kj::Array<byte> owned;            // Backing store if the bytes were copied; null if borrowed.
+    kj::ArrayPtr<const byte> bytes;   // The unwritten remainder.
+    kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> fulfiller;
+    // If non-null, fulfilled when the segment has been fully written.
+
+    uint64_t writeId = 0;
+    // For borrowed segments:  identifies the write this segment belongs to, for disarming.
+
+    kj::Maybe<kj::Own<WriteCanceler>> canceler;
+    // On a borrowed write's last segment:  the stream-side reference, nulled at completion.
+  };
+
+  std::deque<OutSegment> outQueue;
+  size_t queuedBytes = 0;
+  uint64_t lastWriteId = 0;
+  bool flushScheduled = false;   // A loop-tail flush is pending with the event port.
+  bool waitingWritable = false;  // The kernel buffer filled up; flushing resumes via onWritable.
+  bool shutdownAfterFlush = false;
+  kj::Promise<void> flushTask = kj::READY_NOW;
+
+  kj::Promise<void> queueWrite(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) {
+    // All writes are queued and flushed together at the tail of the current libuv loop
+    // iteration (UvEventPort::drainFlushQueue()), so however many messages get written during
+    // one iteration, they go out in a single writev() -- that's the cork.  If the kernel buffer
+    // fills, flushing continues via writability notifications instead.
+
+    size_t total = 0;
+    for (auto piece: pieces) {
+      total += piece.size();
+    }
+    if (total == 0) {
       return kj::READY_NOW;
+    }
+
+    bool copied = total < COPY_THRESHOLD;
+    if (copied) {
+      auto copy = kj::heapArray<byte>(total);
+      byte* target = copy.begin();
+      for (auto piece: pieces) {
+        memcpy(target, piece.begin(), piece.size());
+        target += piece.size();
+      }
+      kj::ArrayPtr<const byte> ptr = copy;
+      outQueue.push_back(OutSegment { kj::mv(copy), ptr, nullptr });
     } else {
-      buffer = reinterpret_cast<const byte*>(buffer) + n;
-      size -= n;
+      uint64_t id = ++lastWriteId;
+      for (auto piece: pieces) {
+        if (piece.size() > 0) {
+          outQueue.push_back(OutSegment { nullptr, piece, nullptr, id });
+        }
+      }
     }
+    queuedBytes += total;
 
-    return onWritable().then([=]() {
-      return write(buffer, size);
-    });
+    if (!flushScheduled && !waitingWritable) {
+      flushScheduled = true;
+      port.scheduleFlush(this);
+    }
+
+    if (copied) {
+      if (queuedBytes < CORK_THRESHOLD) {
+        return kj::READY_NOW;
+      }
+
+      // Backlogged:  resolve when this write has actually gone out.  (The bytes are our own
+      // copy, so cancellation needs no special handling.)
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      outQueue.back().fulfiller = kj::mv(paf.fulfiller);
+      return kj::mv(paf.promise);
+    }
+
+    // Borrowed write:  resolve when its last segment has been written, and arm a canceler so
+    // that if the caller instead drops the promise -- after which it may free the buffer at any
+    // moment -- the queued segments are withdrawn before the flush can touch freed memory.
+    auto canceler = kj::refcounted<WriteCanceler>(this, lastWriteId);
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    auto& last = outQueue.back();
+    last.fulfiller = kj::mv(paf.fulfiller);
+    last.canceler = kj::addRef(*canceler);
+    return paf.promise.attach(kj::defer([KJ_MVCAP(canceler)]() {
+      if (canceler->stream != nullptr) {
+        canceler->stream->disarmWrite(canceler->id);
+      }
+    }));
   }
 
-  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
-    if (pieces.size() == 0) {
-      return writeInternal(nullptr, nullptr);
-    } else {
-      return writeInternal(pieces[0], pieces.slice(1, pieces.size()));
+  void disarmWrite(uint64_t id) {
+    // A borrowed write's promise was canceled.  Drop its unwritten segments; abandoning the
+    // tail of a message is fine, since cancellation means the caller is tearing the stream
+    // down anyway.
+
+    for (auto iter = outQueue.begin(); iter != outQueue.end();) {
+      if (iter->writeId == id) {
+        queuedBytes -= iter->bytes.size();
+        iter = outQueue.erase(iter);
+      } else {
+        ++iter;
+      }
     }
   }
 
-  void shutdownWrite() override {
-    // There's no legitimate way to get an AsyncStreamFd that isn't a socket through the
-    // UnixAsyncIoProvider interface.
-    KJ_SYSCALL(shutdown(fd, SHUT_WR));
+  enum class FlushResult { PROGRESS, WOULD_BLOCK, BROKEN };
+
+  FlushResult tryFlushOnce() {
+    size_t count = kj::min(outQueue.size(), MAX_WRITEV_SEGMENTS);
+    KJ_STACK_ARRAY(struct iovec, iov, count, 16, 64);
+    for (size_t i = 0; i < count; i++) {
+      // writev() interface is not const-correct.  :(
+      iov[i].iov_base = const_cast<byte*>(outQueue[i].bytes.begin());
+      iov[i].iov_len = outQueue[i].bytes.size();
+    }
+
+    ssize_t writeResult;
+    KJ_NONBLOCKING_SYSCALL(writeResult = ::writev(fd, iov.begin(), iov.size())) {
+      // Error.  The next read will discover it.  (We can't return from inside this block
+      // because it causes a memory leak due to a bug that exists in both Clang and GCC:
+      //   http://gcc.gnu.org/bugzilla/show_bug.cgi?id=33799
+      //   http://llvm.org/bugs/show_bug.cgi?id=12286
+      // Hence the goto.)
+      goto error;
+    }
+    if (false) {
+    error:
+      return FlushResult::BROKEN;
+    }
+
+    if (writeResult <= 0) {
+      // A negative result means EAGAIN.  (Zero can't happen for non-empty segments, but treat
+      // it like EAGAIN rather than risk spinning.)
+      return FlushResult::WOULD_BLOCK;
+    }
+
+    consume((size_t)writeResult);
+    return FlushResult::PROGRESS;
+  }
+
+  void consume(size_t n) {
+    queuedBytes -= n;
+    while (n > 0) {
+      auto& segment = outQueue.front();
+      if (n >= segment.bytes.size()) {
+        n -= segment.bytes.size();
+        KJ_IF_MAYBE(f, segment.fulfiller) {
+          f->get()->fulfill();
+        }
+        KJ_IF_MAYBE(c, segment.canceler) {
+          (*c)->stream = nullptr;  // Write completed; nothing left to cancel.
+        }
+        outQueue.pop_front();
+      } else {
+        segment.bytes = segment.bytes.slice(n, segment.bytes.size());
+        n = 0;
+      }
+    }
+  }
+
+  void flushNow() {
+    while (!outQueue.empty()) {
+      switch (tryFlushOnce()) {
+        case FlushResult::PROGRESS:
+          continue;
+
+        case FlushResult::WOULD_BLOCK:
+          if (!waitingWritable) {
+            waitingWritable = true;
+            flushTask = onWritable().then([this]() {
+              waitingWritable = false;
+              flushNow();
+            });
+          }
+          return;
+
+        case FlushResult::BROKEN:
+          // Drop the backlog and resolve everyone; the next read will discover the problem.
+          queuedBytes = 0;
+          while (!outQueue.empty()) {
+            KJ_IF_MAYBE(f, outQueue.front().fulfiller) {
+              f->get()->fulfill();
+            }
+            KJ_IF_MAYBE(c, outQueue.front().canceler) {
+              (*c)->stream = nullptr;
+            }
+            outQueue.pop_front();
+          }
+          break;
+      }
+      break;
+    }
+
+    if (outQueue.empty() && shutdownAfterFlush) {
+      shutdownAfterFlush = false;
+      KJ_SYSCALL(shutdown(fd, SHUT_WR));
+    }
   }
 
-private:
   kj::Promise<size_t> tryReadInternal(void* buffer, size_t minBytes, size_t maxBytes,
                                       size_t alreadyRead) {
     // `alreadyRead` is the number of bytes we have already received via previous reads -- minBytes,
@@ -384,64 +672,33 @@ private:
     }
   }
 
-  kj::Promise<void> writeInternal(kj::ArrayPtr<const byte> firstPiece,
-                                  kj::ArrayPtr<const kj::ArrayPtr<const byte>> morePieces) {
-    KJ_STACK_ARRAY(struct iovec, iov, 1 + morePieces.size(), 16, 128);
+};
 
-    // writev() interface is not const-correct.  :(
-    iov[0].iov_base = const_cast<byte*>(firstPiece.begin());
-    iov[0].iov_len = firstPiece.size();
-    for (uint i = 0; i < morePieces.size(); i++) {
-      iov[i + 1].iov_base = const_cast<byte*>(morePieces[i].begin());
-      iov[i + 1].iov_len = morePieces[i].size();
-    }
+constexpr size_t UvIoStream::CORK_THRESHOLD;
+constexpr size_t UvIoStream::COPY_THRESHOLD;
+constexpr size_t UvIoStream::MAX_WRITEV_SEGMENTS;
 
-    ssize_t writeResult;
-    KJ_NONBLOCKING_SYSCALL(writeResult = ::writev(fd, iov.begin(), iov.size())) {
-      // Error.
+void UvEventPort::drainFlushQueue() {
+  // Flush every stream that queued output during this loop iteration.  Runs after kjLoop.run()
+  // in run(), so all the messages the drain produced go out together.
 
-      // We can't "return kj::READY_NOW;" inside this block because it causes a memory leak due to
-      // a bug that exists in both Clang and GCC:
-      //   http://gcc.gnu.org/bugzilla/show_bug.cgi?id=33799
-      //   http://llvm.org/bugs/show_bug.cgi?id=12286
-      goto error;
-    }
-    if (false) {
-    error:
-      return kj::READY_NOW;
-    }
-
-    // A negative result means EAGAIN, which we can treat the same as having written zero bytes.
-    size_t n = writeResult < 0 ? 0 : writeResult;
-
-    // Discard all data that was written, then issue a new write for what's left (if any).
-    for (;;) {
-      if (n < firstPiece.size()) {
-        // Only part of the first piece was consumed.  Wait for POLLOUT and then write again.
-        firstPiece = firstPiece.slice(n, firstPiece.size());
-        return onWritable().then([=]() {
-          return writeInternal(firstPiece, morePieces);
-        });
-      } else if (morePieces.size() == 0) {
-        // First piece was fully-consumed and there are no more pieces, so we're done.
-        KJ_DASSERT(n == firstPiece.size(), n);
-        return kj::READY_NOW;
-      } else {
-        // First piece was fully consumed, so move on to the next piece.
-        n -= firstPiece.size();
-        firstPiece = morePieces[0];
-        morePieces = morePieces.slice(1, morePieces.size());
+  while (flushQueue.size() > 0) {
+    auto streams = kj::mv(flushQueue);
+    flushQueue = kj::Vector<UvIoStream*>();
+    for (auto stream: streams) {
+      if (stream != nullptr) {
+        stream->flushFromPort();
       }
     }
   }
-};
+}
 
 class UvConnectionReceiver final: public kj::ConnectionReceiver, public OwnedFileDescriptor {
   // Like UvIoStream but for ConnectionReceiver.  This is also largely copied from kj/async-io.c++.
 
 public:
-  UvConnectionReceiver(uv_loop_t* loop, int fd, uint flags)
-      : OwnedFileDescriptor(loop, fd, flags) {}
+  UvConnectionReceiver(UvEventPort& port, int fd, uint flags)
+      : OwnedFileDescriptor(port.getUvLoop(), fd, flags), port(port) {}
 
   kj::Promise<kj::Own<kj::AsyncIoStream>> accept() override {
     int newFd;
@@ -454,7 +711,7 @@ public:
 #endif
 
     if (newFd >= 0) {
-      return kj::Own<kj::AsyncIoStream>(kj::heap<UvIoStream>(uvLoop, newFd, NEW_FD_FLAGS));
+      return kj::Own<kj::AsyncIoStream>(kj::heap<UvIoStream>(port, newFd, NEW_FD_FLAGS));
     } else {
       int error = errno;
 
@@ -504,6 +761,9 @@ public:
       default: return 0;
     }
   }
+
+private:
+  UvEventPort& port;
 };
 
 class UvLowLevelAsyncIoProvider final: public kj::LowLevelAsyncIoProvider {
@@ -511,18 +771,19 @@ public:
   UvLowLevelAsyncIoProvider(uv_loop_t* loop): eventPort(loop), waitScope(eventPort.getKjLoop()) {}
 
   inline kj::WaitScope& getWaitScope() { return waitScope; }
+  inline UvEventPort& getEventPort() { return eventPort; }
 
   kj::Own<kj::AsyncInputStream> wrapInputFd(int fd, uint flags = 0) override {
-    return kj::heap<UvIoStream>(eventPort.getUvLoop(), fd, flags);
+    return kj::heap<UvIoStream>(eventPort, fd, flags);
   }
   kj::Own<kj::AsyncOutputStream> wrapOutputFd(int fd, uint flags = 0) override {
-    return kj::heap<UvIoStream>(eventPort.getUvLoop(), fd, flags);
+    return kj::heap<UvIoStream>(eventPort, fd, flags);
   }
   kj::Own<kj::AsyncIoStream> wrapSocketFd(int fd, uint flags = 0) override {
-    return kj::heap<UvIoStream>(eventPort.getUvLoop(), fd, flags);
+    return kj::heap<UvIoStream>(eventPort, fd, flags);
   }
   kj::Promise<kj::Own<kj::AsyncIoStream>> wrapConnectingSocketFd(int fd, uint flags = 0) override {
-    auto result = kj::heap<UvIoStream>(eventPort.getUvLoop(), fd, flags);
+    auto result = kj::heap<UvIoStream>(eventPort, fd, flags);
     auto connected = result->onWritable();
     return connected.then(kj::mvCapture(result,
         [fd](kj::Own<kj::AsyncIoStream>&& stream) {
@@ -536,7 +797,7 @@ public:
         }));
   }
   kj::Own<kj::ConnectionReceiver> wrapListenSocketFd(int fd, uint flags = 0) override {
-    return kj::heap<UvConnectionReceiver>(eventPort.getUvLoop(), fd, flags);
+    return kj::heap<UvConnectionReceiver>(eventPort, fd, flags);
   }
 
 private:
@@ -831,6 +1092,69 @@ v8::Handle<v8::Value> wrapBuffer(kj::Array<T>&& array) {
 // =======================================================================================
 // Cap'n Proto bindings
 
+class SegmentPool {
+  // Recycles first-segment scratch space for the MallocMessageBuilders behind JS-visible
+  // builders, so that the shell's steady stream of small messages doesn't pay a malloc plus a
+  // cache-cold segment for each one.  Segments are zeroed ("scrubbed") when returned, since
+  // MallocMessageBuilder requires zeroed scratch, and the segment size adapts to the sizes of
+  // the messages actually built:  whenever a message mostly fills the current size, future
+  // segments double (up to a cap), and the free list of the old size is discarded.
+
+public:
+  kj::Array<capnp::word> take() {
+    if (freeList.size() > 0) {
+      auto result = kj::mv(freeList[freeList.size() - 1]);
+      freeList.resize(freeList.size() - 1);
+      return result;
+    }
+
+    auto result = kj::heapArray<capnp::word>(segmentWords);
+    memset(result.begin(), 0, result.size() * sizeof(capnp::word));
+    return result;
+  }
+
+  void release(kj::Array<capnp::word>&& segment) {
+    if (segment.size() == segmentWords && freeList.size() < MAX_POOLED) {
+      memset(segment.begin(), 0, segment.size() * sizeof(capnp::word));
+      freeList.add(kj::mv(segment));
+    }
+    // Otherwise just let it free:  it's from an old size generation, or the pool is full.
+  }
+
+  void noteUsage(size_t wordsUsed) {
+    // Called with the total size of a finished message.  If messages are outgrowing the scratch
+    // segment, grow it so future messages fit in one segment again.
+
+    if (wordsUsed > segmentWords - segmentWords / 4 && segmentWords < MAX_SEGMENT_WORDS) {
+      segmentWords = segmentWords * 2;
+      freeList.resize(0);
+    }
+  }
+
+private:
+  static constexpr size_t MAX_POOLED = 16;
+  static constexpr size_t MAX_SEGMENT_WORDS = 65536;  // 512k
+
+  size_t segmentWords = 1024;  // 8k to start.
+  kj::Vector<kj::Array<capnp::word>> freeList;
+};
+
+constexpr size_t SegmentPool::MAX_POOLED;
+constexpr size_t SegmentPool::MAX_SEGMENT_WORDS;
+
+struct PooledSegment {
+  // Owns a segment borrowed from a SegmentPool, returning it on destruction.  Declared as the
+  // first member of its user so it is destroyed last, after the message using the memory.
+
+  SegmentPool& pool;
+  kj::Array<capnp::word> words;
+
+  explicit PooledSegment(SegmentPool& pool): pool(pool), words(pool.take()) {}
+  ~PooledSegment() { pool.release(kj::mv(words)); }
+  KJ_DISALLOW_COPY(PooledSegment);
+};
+
+
 struct CapnpContext {
   // Shared context initialized when the module starts up.  This gets passed to each function as
   // the "data".
@@ -838,6 +1162,11 @@ struct CapnpContext {
   UvLowLevelAsyncIoProvider llaiop;
   kj::Own<kj::AsyncIoProvider> aiop;
   capnp::SchemaParser parser;
+  capnp::SchemaLoader loader;
+  // Loader for schemas that come from the compiled-schema cache rather than the text parser;
+  // see importCompiled().
+  SegmentPool segmentPool;
+  // Recycled scratch for JS-visible message builders.
   Wrapper wrapper;
 
   std::unordered_map<uint64_t, OwnHandle<v8::Object>> importedFiles;
@@ -854,6 +1183,26 @@ struct CapnpContext {
       aiop(kj::newAsyncIoProvider(llaiop)) {}
 };
 
+v8::Handle<v8::Value> loopStats(const v8::Arguments& args) {
+  // loopStats() -> {wakeupsRequested, drains}
+  //
+  // Counters from the KJ-on-libuv glue:  how many times KJ events became runnable vs. how many
+  // times the queue was actually drained.  The ratio shows how well wakeup batching is working
+  // in production.
+
+  KJV8_UNWRAP(CapnpContext, context, args.Data());
+
+  return liftKj([&]() -> v8::Handle<v8::Value> {
+    auto& port = context.llaiop.getEventPort();
+    auto result = v8::Object::New();
+    result->Set(v8::String::NewSymbol("wakeupsRequested"),
+                v8::Number::New((double)port.getWakeupsRequested()));
+    result->Set(v8::String::NewSymbol("drains"),
+                v8::Number::New((double)port.getDrains()));
+    return result;
+  });
+}
+
 v8::Handle<v8::Value> setNative(const v8::Arguments& args) {
   // setNative(object, nativeHandle)
   //
@@ -881,6 +1230,261 @@ v8::Local<v8::Object> schemaToObject(capnp::ParsedSchema schema, CapnpContext& c
   return result;
 }
 
+v8::Local<v8::Object> loadedSchemaToObject(capnp::Schema schema, CapnpContext& context,
+                                           v8::Handle<v8::Value> wrappedContext) {
+  // Like schemaToObject(), but for schemas living in context.loader (which resolves nested
+  // nodes by id rather than by name).
+
+  auto result = context.wrapper.wrap(new capnp::Schema(schema));
+
+  for (auto nested: schema.getProto().getNestedNodes()) {
+    result->Set(v8::String::NewSymbol(nested.getName().cStr()),
+                loadedSchemaToObject(context.loader.get(nested.getId()), context,
+                                     wrappedContext));
+  }
+
+  return result;
+}
+
+// -----------------------------------------------------------------------------
+// Compiled-schema cache
+//
+// SchemaParser::parseDiskFile() re-parses the same schema text on every process start, which
+// costs the shell hundreds of milliseconds per boot.  Instead we compile each imported file to
+// its binary node graph once -- by running `capnp compile -o-`, which also captures the implicit
+// group and parameter-struct nodes that the nested-node tree doesn't enumerate -- and store the
+// resulting CodeGeneratorRequest next to the source, keyed by the size and mtime of the source
+// and its resolvable imports.  Subsequent imports feed the nodes straight into a SchemaLoader,
+// skipping the text parser entirely.  Any failure along this path (no capnp binary, unwritable
+// directory, stale or corrupt cache that can't be refreshed) just falls back to the in-process
+// text parser.
+
+struct SchemaCacheEntry {
+  kj::String path;
+  uint64_t size;
+  int64_t mtimeNs;
+};
+
+kj::Maybe<SchemaCacheEntry> statCacheEntry(kj::StringPtr path) {
+  struct stat stats;
+  if (stat(path.cStr(), &stats) < 0) {
+    return nullptr;
+  }
+  return SchemaCacheEntry {
+    kj::heapString(path),
+    (uint64_t)stats.st_size,
+    stats.st_mtim.tv_sec * 1000000000ll + stats.st_mtim.tv_nsec
+  };
+}
+
+kj::Array<byte> runCapnpCompile(kj::StringPtr diskPath,
+                                kj::ArrayPtr<const kj::StringPtr> searchPath) {
+  // Run `capnp compile -o- <diskPath>` and return its binary output.
+
+  int pipeFds[2];
+  KJ_SYSCALL(pipe(pipeFds));
+
+  pid_t pid;
+  KJ_SYSCALL(pid = fork());
+  if (pid == 0) {
+    close(pipeFds[0]);
+    dup2(pipeFds[1], STDOUT_FILENO);
+
+    kj::Vector<kj::String> ownedArgs;
+    kj::Vector<const char*> argv;
+    argv.add("capnp");
+    argv.add("compile");
+    argv.add("-o-");
+    for (auto& dir: searchPath) {
+      ownedArgs.add(kj::str("-I", dir));
+      argv.add(ownedArgs[ownedArgs.size() - 1].cStr());
+    }
+    argv.add(diskPath.cStr());
+    argv.add(nullptr);
+
+    execvp("capnp", const_cast<char**>(argv.begin()));
+    _exit(1);
+  }
+
+  close(pipeFds[1]);
+  kj::AutoCloseFd readEnd(pipeFds[0]);
+
+  kj::Vector<byte> output;
+  for (;;) {
+    byte buffer[8192];
+    ssize_t n;
+    KJ_SYSCALL(n = read(readEnd, buffer, sizeof(buffer)));
+    if (n == 0) break;
+    output.addAll(kj::arrayPtr(buffer, n));
+  }
+
+  int status;
+  KJ_SYSCALL(waitpid(pid, &status, 0));
+  KJ_REQUIRE(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+             "capnp compile failed.", diskPath);
+
+  return output.releaseAsArray();
+}
+
+uint64_t loadCompiledNodes(CapnpContext& context, kj::ArrayPtr<const byte> bytes) {
+  // Load a serialized CodeGeneratorRequest into context.loader, returning the requested file's
+  // node id.
+
+  auto words = kj::heapArray<capnp::word>(bytes.size() / sizeof(capnp::word));
+  memcpy(words.begin(), bytes.begin(), words.size() * sizeof(capnp::word));
+
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = words.size();
+  capnp::FlatArrayMessageReader reader(words, options);
+  auto request = reader.getRoot<capnp::schema::CodeGeneratorRequest>();
+
+  for (auto node: request.getNodes()) {
+    context.loader.load(node);
+  }
+
+  auto requestedFiles = request.getRequestedFiles();
+  KJ_REQUIRE(requestedFiles.size() == 1, "Expected exactly one requested file.");
+  return requestedFiles[0].getId();
+}
+
+kj::Maybe<uint64_t> importCompiled(CapnpContext& context, kj::StringPtr diskPath,
+                                   kj::ArrayPtr<const kj::StringPtr> searchPath) {
+  // Import `diskPath` via the compiled-schema cache, returning the file's node id, or null if
+  // the caller should fall back to the text parser.
+
+  uint64_t result = 0;
+  bool done = false;
+
+  kj::runCatchingExceptions([&]() {
+    auto cachePath = kj::str(diskPath, ".schema-cache");
+
+    // Try the existing cache file.
+    {
+      int fd = open(cachePath.cStr(), O_RDONLY);
+      if (fd >= 0) {
+        kj::AutoCloseFd closer(fd);
+        kj::FdInputStream in(fd);
+
+        kj::Vector<byte> content;
+        for (;;) {
+          byte buffer[8192];
+          size_t n = in.tryRead(buffer, 1, sizeof(buffer));
+          if (n == 0) break;
+          content.addAll(kj::arrayPtr(buffer, n));
+        }
+
+        // The header is a line per source file ("<size> <mtimeNs> <path>"), then a blank line,
+        // then the binary node graph.
+        bool valid = true;
+        size_t pos = 0;
+        for (;;) {
+          size_t lineEnd = pos;
+          while (lineEnd < content.size() && content[lineEnd] != '\n') ++lineEnd;
+          if (lineEnd >= content.size()) { valid = false; break; }
+          if (lineEnd == pos) { pos = lineEnd + 1; break; }  // Blank line:  end of header.
+
+          auto line = kj::heapString(
+              reinterpret_cast<char*>(content.begin() + pos), lineEnd - pos);
+          char* rest;
+          uint64_t size = strtoull(line.cStr(), &rest, 10);
+          int64_t mtimeNs = strtoll(rest, &rest, 10);
+          while (*rest == ' ') ++rest;
+
+          KJ_IF_MAYBE(entry, statCacheEntry(rest)) {
+            if (entry->size != size || entry->mtimeNs != mtimeNs) {
+              valid = false;
+            }
+          } else {
+            valid = false;
+          }
+          if (!valid) break;
+          pos = lineEnd + 1;
+        }
+
+        if (valid) {
+          result = loadCompiledNodes(
+              context, kj::arrayPtr(content.begin() + pos, content.size() - pos));
+          done = true;
+          return;
+        }
+      }
+    }
+
+    // Cache miss or stale:  compile the schema to its binary form.
+    auto compiled = runCapnpCompile(diskPath, searchPath);
+
+    // Figure out which files the cache entry depends on, for invalidation.  Imports that we
+    // can't resolve to a path (e.g. system imports like /capnp/c++.capnp, which live wherever
+    // the capnp installation does) simply aren't validated; they only change when capnp itself
+    // is upgraded.
+    kj::Vector<SchemaCacheEntry> entries;
+    KJ_IF_MAYBE(root, statCacheEntry(diskPath)) {
+      entries.add(kj::mv(*root));
+    }
+
+    {
+      auto words = kj::heapArray<capnp::word>(compiled.size() / sizeof(capnp::word));
+      memcpy(words.begin(), compiled.begin(), words.size() * sizeof(capnp::word));
+      capnp::ReaderOptions options;
+      options.traversalLimitInWords = words.size();
+      capnp::FlatArrayMessageReader reader(words, options);
+      auto request = reader.getRoot<capnp::schema::CodeGeneratorRequest>();
+
+      kj::StringPtr dir = diskPath;
+      size_t slash = 0;
+      for (size_t i = 0; i < dir.size(); i++) {
+        if (dir[i] == '/') slash = i;
+      }
+      auto dirPrefix = kj::heapString(dir.begin(), slash);
+
+      for (auto file: request.getRequestedFiles()) {
+        for (auto import: file.getImports()) {
+          kj::StringPtr name = import.getName();
+          if (name.startsWith("/")) {
+            for (auto& searchDir: searchPath) {
+              KJ_IF_MAYBE(entry, statCacheEntry(kj::str(searchDir, name))) {
+                entries.add(kj::mv(*entry));
+                break;
+              }
+            }
+          } else {
+            KJ_IF_MAYBE(entry, statCacheEntry(kj::str(dirPrefix, "/", name))) {
+              entries.add(kj::mv(*entry));
+            }
+          }
+        }
+      }
+    }
+
+    // Write the cache atomically, so a half-written file never gets loaded.
+    {
+      auto newPath = kj::str(cachePath, ".new");
+      int fd;
+      KJ_SYSCALL(fd = open(newPath.cStr(), O_WRONLY | O_CREAT | O_TRUNC, 0666));
+      {
+        kj::AutoCloseFd closer(fd);
+        kj::FdOutputStream out(fd);
+        for (auto& entry: entries) {
+          auto line = kj::str(entry.size, " ", entry.mtimeNs, " ", entry.path, "\n");
+          out.write(line.begin(), line.size());
+        }
+        out.write("\n", 1);
+        out.write(compiled.begin(), compiled.size());
+      }
+      KJ_SYSCALL(rename(newPath.cStr(), cachePath.cStr()));
+    }
+
+    result = loadCompiledNodes(context, compiled);
+    done = true;
+  });
+
+  if (done) {
+    return result;
+  } else {
+    return nullptr;
+  }
+}
+
 v8::Handle<v8::Value> import(const v8::Arguments& args) {
   // import(displayName, diskPath, searchPath) -> schema
   //
@@ -910,6 +1514,16 @@ v8::Handle<v8::Value> import(const v8::Arguments& args) {
       }
     }
 
+    // Prefer the compiled-schema cache, which skips the text parser; fall back to
+    // parseDiskFile() if that path fails for any reason.
+    KJ_IF_MAYBE(fileId, importCompiled(context, diskPath, searchPathPtrs)) {
+      auto& slot = context.importedFiles[*fileId];
+      if (slot == nullptr) {
+        slot = loadedSchemaToObject(context.loader.get(*fileId), context, args.Data());
+      }
+      return slot.get();
+    }
+
     capnp::ParsedSchema schema = context.parser.parseDiskFile(
         displayName, diskPath, searchPathPtrs);
     auto& slot = context.importedFiles[schema.getProto().getId()];
@@ -968,16 +1582,29 @@ v8::Handle<v8::Value> methods(const v8::Arguments& args) {
 }
 
 struct StructBuilder {
+  PooledSegment segment;
   capnp::MallocMessageBuilder message;
   capnp::DynamicStruct::Builder root;
 
-  explicit StructBuilder(capnp::StructSchema schema)
-      : root(message.getRoot<capnp::DynamicStruct>(schema)) {}
-  explicit StructBuilder(capnp::DynamicStruct::Reader reader)
-      : root(nullptr) {
+  explicit StructBuilder(capnp::StructSchema schema, SegmentPool& pool)
+      : segment(pool),
+        message(segment.words, capnp::AllocationStrategy::GROW_HEURISTICALLY),
+        root(message.getRoot<capnp::DynamicStruct>(schema)) {}
+  explicit StructBuilder(capnp::DynamicStruct::Reader reader, SegmentPool& pool)
+      : segment(pool),
+        message(segment.words, capnp::AllocationStrategy::GROW_HEURISTICALLY),
+        root(nullptr) {
     message.setRoot(reader);
     root = message.getRoot<capnp::DynamicStruct>(reader.getSchema());
   }
+
+  ~StructBuilder() {
+    size_t wordsUsed = 0;
+    for (auto s: message.getSegmentsForOutput()) {
+      wordsUsed += s.size();
+    }
+    segment.pool.noteUsage(wordsUsed);
+  }
 };
 
 struct ServerResults: public kj::Refcounted {
@@ -1064,7 +1691,7 @@ v8::Handle<v8::Value> newBuilder(const v8::Arguments& args) {
       return v8::Handle<v8::Value>();
     }
 
-    return context.wrapper.wrap(new StructBuilder(schema.asStruct()));
+    return context.wrapper.wrap(new StructBuilder(schema.asStruct(), context.segmentPool));
   });
 }
 
@@ -1077,7 +1704,7 @@ v8::Handle<v8::Value> copyBuilder(const v8::Arguments& args) {
   KJV8_UNWRAP_READER(reader, args[0]);
 
   return liftKj([&]() -> v8::Handle<v8::Value> {
-    return context.wrapper.wrap(new StructBuilder(reader));
+    return context.wrapper.wrap(new StructBuilder(reader, context.segmentPool));
   });
 }
 
@@ -1377,11 +2004,54 @@ v8::Handle<v8::Value> fromJs(const v8::Arguments& args) {
 
 bool fieldToJs(CapnpContext& context, v8::Handle<v8::Object> object,
                capnp::DynamicStruct::Reader reader, capnp::StructSchema::Field field,
-               v8::Handle<v8::Value> capConstructor);
+               v8::Handle<v8::Value> capConstructor, v8::Handle<v8::Value> owner);
+
+struct PinnedBufferOwner {
+  // Keeps the wrapper for a message alive for as long as some external Buffer views its
+  // memory.
+  OwnHandle<v8::Value> owner;
+};
+
+void releasePinnedBuffer(char* data, void* hint) {
+  delete reinterpret_cast<PinnedBufferOwner*>(hint);
+}
+
+static constexpr size_t MIN_EXTERNAL_BUFFER_SIZE = 2048;
+// Data fields at least this large are exposed to JS as external Buffers viewing the message
+// segment directly, with no copy; the message's wrapper is pinned until the Buffer is
+// collected.  Below this size the bookkeeping costs more than the memcpy.
+
+v8::Handle<v8::Value> bufferOwnerFor(v8::Handle<v8::Value> handle) {
+  // Returns `handle` if it wraps an object which itself owns its message's memory, making it
+  // safe to anchor zero-copy views; otherwise returns an empty handle, forcing a copy.  In
+  // particular a ServerRequest's params (and a ServerResults' builder) live only until the call
+  // returns -- the RPC system frees the message then, no matter how long the JS wrapper
+  // survives -- so views into them must not be taken.
+
+  typedef capnp::Response<capnp::DynamicStruct> Response;
+  typedef capnp::Request<capnp::DynamicStruct, capnp::DynamicStruct> Request;
+  if (Wrapper::tryUnwrap<Response>(handle) != nullptr ||
+      Wrapper::tryUnwrap<StructReader>(handle) != nullptr ||
+      Wrapper::tryUnwrap<StructBuilder>(handle) != nullptr ||
+      Wrapper::tryUnwrap<Request>(handle) != nullptr) {
+    return handle;
+  }
+  return emptyHandle;
+}
+
+v8::Handle<v8::Value> wrapDataView(capnp::Data::Reader data, v8::Handle<v8::Value> owner) {
+  // Zero-copy view.  Note that if `owner` wraps a *builder*, later modifications through the
+  // builder are visible through the Buffer -- it is a true view of the message memory.
+
+  return node::Buffer::New(
+      const_cast<char*>(reinterpret_cast<const char*>(data.begin())), data.size(),
+      &releasePinnedBuffer, new PinnedBufferOwner { OwnHandle<v8::Value>(owner) })->handle_;
+}
 
 v8::Handle<v8::Value> valueToJs(CapnpContext& context, capnp::DynamicValue::Reader value,
                                 capnp::schema::Type::Which whichType,
-                                v8::Handle<v8::Value> capConstructor) {
+                                v8::Handle<v8::Value> capConstructor,
+                                v8::Handle<v8::Value> owner) {
   switch (value.getType()) {
     case capnp::DynamicValue::UNKNOWN:
       return v8::Undefined();
@@ -1415,6 +2085,9 @@ v8::Handle<v8::Value> valueToJs(CapnpContext& context, capnp::DynamicValue::Read
     }
     case capnp::DynamicValue::DATA: {
       capnp::Data::Reader data = value.as<capnp::Data>();
+      if (data.size() >= MIN_EXTERNAL_BUFFER_SIZE && !owner.IsEmpty()) {
+        return wrapDataView(data, owner);
+      }
       return node::Buffer::New(reinterpret_cast<const char*>(data.begin()), data.size())->handle_;
     }
     case capnp::DynamicValue::LIST: {
@@ -1423,7 +2096,7 @@ v8::Handle<v8::Value> valueToJs(CapnpContext& context, capnp::DynamicValue::Read
       auto elementType = list.getSchema().whichElementType();
       auto array = v8::Array::New(list.size());
       for (uint i: kj::indices(list)) {
-        auto subValue = valueToJs(context, list[i], elementType, capConstructor);
+        auto subValue = valueToJs(context, list[i], elementType, capConstructor, owner);
         if (subValue.IsEmpty()) {
           return emptyHandle;
         }
@@ -1444,14 +2117,14 @@ v8::Handle<v8::Value> valueToJs(CapnpContext& context, capnp::DynamicValue::Read
       capnp::DynamicStruct::Reader reader = value.as<capnp::DynamicStruct>();
       auto object = v8::Object::New();
       KJ_IF_MAYBE(field, reader.which()) {
-        if (!fieldToJs(context, object, reader, *field, capConstructor)) {
+        if (!fieldToJs(context, object, reader, *field, capConstructor, owner)) {
           return emptyHandle;
         }
       }
 
       for (auto field: reader.getSchema().getNonUnionFields()) {
         if (reader.has(field)) {
-          if (!fieldToJs(context, object, reader, field, capConstructor)) {
+          if (!fieldToJs(context, object, reader, field, capConstructor, owner)) {
             return emptyHandle;
           }
         }
@@ -1483,19 +2156,19 @@ v8::Handle<v8::Value> valueToJs(CapnpContext& context, capnp::DynamicValue::Read
 
 bool fieldToJs(CapnpContext& context, v8::Handle<v8::Object> object,
                capnp::DynamicStruct::Reader reader, capnp::StructSchema::Field field,
-               v8::Handle<v8::Value> capConstructor) {
+               v8::Handle<v8::Value> capConstructor, v8::Handle<v8::Value> owner) {
   auto proto = field.getProto();
   v8::Handle<v8::Value> fieldValue;
   switch (proto.which()) {
     case capnp::schema::Field::SLOT:
       fieldValue = valueToJs(context, reader.get(field), proto.getSlot().getType().which(),
-                             capConstructor);
+                             capConstructor, owner);
       goto setField;
     case capnp::schema::Field::GROUP:
       // Hack:  We don't have a schema::Type instance to use here, but it turns out valueToJs()
       //   doesn't need one when receiving a struct value.  So, uh...  provide a fake one.  :/
       fieldValue = valueToJs(context, reader.get(field), capnp::schema::Type::STRUCT,
-                             capConstructor);
+                             capConstructor, owner);
       goto setField;
   }
 
@@ -1521,7 +2194,11 @@ v8::Handle<v8::Value> toJs(const v8::Arguments& args) {
   KJV8_UNWRAP_READER(reader, args[0]);
 
   return liftKj([&]() -> v8::Handle<v8::Value> {
-    return valueToJs(context, reader, capnp::schema::Type::STRUCT, args[1]);
+    // args[0], the wrapper for the underlying message, is passed as the owner so that large
+    // Data fields can be exposed as zero-copy views pinning it (when it owns its memory; see
+    // bufferOwnerFor()).
+    return valueToJs(context, reader, capnp::schema::Type::STRUCT, args[1],
+                     bufferOwnerFor(args[0]));
   });
 }
 
@@ -1545,12 +2222,13 @@ v8::Handle<v8::Value> toJsParams(const v8::Arguments& args) {
       auto result = v8::Array::New(fields.size());
       for (uint i: kj::indices(fields)) {
         result->Set(i, valueToJs(context, reader.get(fields[i]),
-                    capnp::schema::Type::STRUCT, args[1]));
+                    capnp::schema::Type::STRUCT, args[1], bufferOwnerFor(args[0])));
       }
       return result;
     } else {
       auto result = v8::Array::New(1);
-      result->Set(1, valueToJs(context, reader, capnp::schema::Type::STRUCT, args[1]));
+      result->Set(1, valueToJs(context, reader, capnp::schema::Type::STRUCT, args[1],
+                               bufferOwnerFor(args[0])));
       return result;
     }
   });
@@ -2144,6 +2822,7 @@ void init(v8::Handle<v8::Object> exports) {
           v8::FunctionTemplate::New(callback, wrappedContext)->GetFunction());
     };
 
+    mapFunction("loopStats", loopStats);
     mapFunction("setNative", setNative);
     mapFunction("import", import);
     mapFunction("methods", methods);